@@ -18,13 +18,6 @@
 
 #include "tg.h"
 
-int fl_cmp(const void *a, const void *b)
-{
-	float x = *(float*)a;
-	float y = *(float*)b;
-	return x<y ? -1 : x>y ? 1 : 0;
-}
-
 int int_cmp(const void *a, const void *b)
 {
 	int x = *(int*)a;
@@ -32,6 +25,44 @@ int int_cmp(const void *a, const void *b)
 	return x<y ? -1 : x>y ? 1 : 0;
 }
 
+static void fl_swap(float *x, int i, int j)
+{
+	float t = x[i];
+	x[i] = x[j];
+	x[j] = t;
+}
+
+/* The k-th smallest of the n values in x, which are reordered in the process.
+   Quickselect with median of three pivots, short ranges are finished by insertion sort. */
+float select_kth(float *x, int n, int k)
+{
+	int lo = 0, hi = n - 1;
+	while(hi - lo > 16) {
+		int mid = lo + (hi - lo) / 2;
+		if(x[mid] < x[lo]) fl_swap(x, lo, mid);
+		if(x[hi] < x[lo]) fl_swap(x, lo, hi);
+		if(x[hi] < x[mid]) fl_swap(x, mid, hi);
+		float pivot = x[mid];
+		int i = lo, j = hi; // x[lo] and x[hi] are already on the right side
+		for(;;) {
+			do i++; while(x[i] < pivot);
+			do j--; while(x[j] > pivot);
+			if(i >= j) break;
+			fl_swap(x, i, j);
+		}
+		if(k <= j) hi = j;
+		else lo = j + 1;
+	}
+	int i, j;
+	for(i = lo + 1; i <= hi; i++) {
+		float t = x[i];
+		for(j = i; j > lo && x[j-1] > t; j--)
+			x[j] = x[j-1];
+		x[j] = t;
+	}
+	return x[k];
+}
+
 void make_hp(struct filter *f, double freq)
 {
 	double K = tan(M_PI * freq);
@@ -54,81 +85,547 @@ void make_lp(struct filter *f, double freq)
 	f->b2 = (1 - K * sqrt(2) + K * K) * norm;
 }
 
-void run_filter(struct filter *f, float *buff, int size)
+/* Filter size samples from in, writing them to out (which may be in).
+   The filter state z is carried over between calls. */
+void filter_block(struct filter *f, float *z, const float *in, float *out, int size)
 {
 	int i;
-	double z1 = 0, z2 = 0;
+	float a0 = f->a0, a1 = f->a1, a2 = f->a2, b1 = f->b1, b2 = f->b2;
+	float z1 = z[0], z2 = z[1];
 	for(i=0; i<size; i++) {
-		double in = buff[i];
-		double out = in * f->a0 + z1;
-		z1 = in * f->a1 + z2 - f->b1 * out;
-		z2 = in * f->a2 - f->b2 * out;
-		buff[i] = out;
+		float x = in[i];
+		float y = x * a0 + z1;
+		z1 = x * a1 + z2 - b1 * y;
+		z2 = x * a2 - b2 * y;
+		out[i] = y;
 	}
+	z[0] = z1;
+	z[1] = z2;
 }
 
-void setup_buffers(struct processing_buffers *b)
+/* Filter FILTER_LANES interleaved channels at once, the loop over the lanes vectorizes */
+static void filter_lanes(struct filter *f, float *restrict z1, float *restrict z2, float *restrict buff, int steps)
 {
-	b->samples = fftwf_malloc(2 * b->sample_count * sizeof(float));
-	b->samples_sc = malloc(2 * b->sample_count * sizeof(float));
-	b->waveform = malloc(2 * b->sample_rate * sizeof(float));
-	b->waveform_sc = malloc(2 * b->sample_rate * sizeof(float));
-	b->fft = fftwf_malloc((b->sample_count + 1) * sizeof(fftwf_complex));
-	b->sc_fft = fftwf_malloc((b->sample_count + 1) * sizeof(fftwf_complex));
-	b->tic_wf = fftwf_malloc(2 * b->sample_count * sizeof(float));
-	b->tic_c = fftwf_malloc(2 * b->sample_count * sizeof(float));
-	b->tic_fft = fftwf_malloc((b->sample_count + 1) * sizeof(fftwf_complex));
-	b->plan_a = fftwf_plan_dft_r2c_1d(2 * b->sample_count, b->samples, b->fft, FFTW_ESTIMATE);
-	b->plan_b = fftwf_plan_dft_c2r_1d(2 * b->sample_count, b->sc_fft, b->samples_sc, FFTW_ESTIMATE);
-	b->plan_c = fftwf_plan_dft_r2c_1d(2 * b->sample_rate, b->waveform, b->sc_fft, FFTW_ESTIMATE);
-	b->plan_d = fftwf_plan_dft_c2r_1d(2 * b->sample_rate, b->sc_fft, b->waveform_sc, FFTW_ESTIMATE);
-	b->plan_e = fftwf_plan_dft_r2c_1d(2 * b->sample_count, b->tic_wf, b->tic_fft, FFTW_ESTIMATE);
-	b->plan_f = fftwf_plan_dft_c2r_1d(2 * b->sample_count, b->sc_fft, b->tic_c, FFTW_ESTIMATE);
-	b->hpf = malloc(sizeof(struct filter));
-	make_hp(b->hpf,(double)FILTER_CUTOFF/b->sample_rate);
-	b->lpf = malloc(sizeof(struct filter));
-	make_lp(b->lpf,(double)FILTER_CUTOFF/b->sample_rate);
-	b->events = malloc(EVENTS_MAX * sizeof(uint64_t));
-	b->ready = 0;
-#ifdef DEBUG
-	b->debug = fftwf_malloc(b->sample_count * sizeof(float));
-#endif
+	int i, j;
+	float a0 = f->a0, a1 = f->a1, a2 = f->a2, b1 = f->b1, b2 = f->b2;
+	for(i = 0; i < steps; i++) {
+		float *x = buff + i * FILTER_LANES;
+		for(j = 0; j < FILTER_LANES; j++) {
+			float y = x[j] * a0 + z1[j];
+			z1[j] = x[j] * a1 + z2[j] - b1 * y;
+			z2[j] = x[j] * a2 - b2 * y;
+			x[j] = y;
+		}
+	}
 }
 
-/* Create a copy of a processing buffer */
-struct processing_buffers *pb_clone(struct processing_buffers *p)
+/* Same as filter_block(), for long blocks. The block is cut in FILTER_LANES segments,
+   filtered side by side from a zero state, a tile at a time. Then the response to the
+   actual initial state of each segment, known once the previous one is done, is added.
+   scratch must have room for 2 * size / FILTER_LANES values. */
+void filter_long(struct filter *f, float *z, const float *in, float *out, int size, float *scratch)
 {
-	struct processing_buffers *new = malloc(sizeof(struct processing_buffers));
-	new->sample_rate = p->sample_rate;
-	new->waveform = malloc(new->sample_rate * sizeof(float));
-    memcpy(new->waveform, p->waveform, new->sample_rate * sizeof(float)); // Copy over waveform data
+	int m = size / FILTER_LANES; // Length of the segments
+	if(m < FILTER_SEGMENT) {
+		filter_block(f, z, in, out, size);
+		return;
+	}
+	float *g1 = scratch;
+	float *g2 = g1 + m;
+	float tile[FILTER_TILE * FILTER_LANES];
+	float z1[FILTER_LANES], z2[FILTER_LANES];
+	int i, j, k;
 
-#ifdef DEBUG
-	new->debug = malloc(p->sample_count * sizeof(float));
-	memcpy(new->debug, p->debug, p->sample_count * sizeof(float));
-#endif
+	for(j = 0; j < FILTER_LANES; j++)
+		z1[j] = z2[j] = 0;
+	z1[0] = z[0];
+	z2[0] = z[1];
+	for(k = 0; k < m; k += FILTER_TILE) {
+		int n = m - k < FILTER_TILE ? m - k : FILTER_TILE;
+		for(i = 0; i < n; i++)
+			for(j = 0; j < FILTER_LANES; j++)
+				tile[i * FILTER_LANES + j] = in[j * m + k + i];
+		filter_lanes(f, z1, z2, tile, n);
+		for(j = 0; j < FILTER_LANES; j++)
+			for(i = 0; i < n; i++)
+				out[j * m + k + i] = tile[i * FILTER_LANES + j];
+	}
 
-    // Copy over the rest of the variables
-	new->sample_count = p->sample_count;
-	new->period = p->period;
-	new->sigma = p->sigma;
-	new->be = p->be;
-	new->waveform_max = p->waveform_max;
-	new->tic_pulse = p->tic_pulse;
-	new->toc_pulse = p->toc_pulse;
-	new->tic = p->tic;
-	new->toc = p->toc;
-	new->ready = p->ready;
-	return new;
+	// Zero input responses to the unit states, which end up in (u1,u2) and (v1,v2)
+	float u1 = 1, u2 = 0, v1 = 0, v2 = 1;
+	for(i = 0; i < m; i++) {
+		g1[i] = u1;
+		g2[i] = v1;
+		float y = u1;
+		u1 = u2 - f->b1 * y;
+		u2 = -f->b2 * y;
+		y = v1;
+		v1 = v2 - f->b1 * y;
+		v2 = -f->b2 * y;
+	}
+
+	float s1 = z1[0], s2 = z2[0];
+	for(j = 1; j < FILTER_LANES; j++) {
+		float *o = out + j * m;
+		for(i = 0; i < m; i++)
+			o[i] += s1 * g1[i] + s2 * g2[i];
+		float n1 = z1[j] + s1 * u1 + s2 * v1;
+		float n2 = z2[j] + s1 * u2 + s2 * v2;
+		s1 = n1;
+		s2 = n2;
+	}
+	z[0] = s1;
+	z[1] = s2;
+	filter_block(f, z, in + m * FILTER_LANES, out + m * FILTER_LANES, size - m * FILTER_LANES);
+}
+
+/* Set up d for the given factor, d must be zeroed or previously set up */
+void setup_decimator(struct decimator *d, int factor)
+{
+	int i, n = DECIMATOR_TAPS * factor;
+	free(d->taps);
+	free(d->buff);
+	free(d->planes);
+	d->factor = factor;
+	d->taps_count = n;
+	if(factor == 1) { // Plain copy
+		d->taps = d->buff = d->planes = NULL;
+		return;
+	}
+	d->taps = malloc(n * sizeof(float));
+	d->buff = malloc((n - 1 + DECIMATOR_BLOCK) * sizeof(float));
+	d->planes = malloc((2 * n + DECIMATOR_BLOCK) * sizeof(float));
+
+	// Blackman windowed sinc, cut off below the output Nyquist frequency
+	double fc = 0.4 / factor;
+	double sum = 0;
+	for(i = 0; i < n; i++) {
+		double x = i - (n - 1) / 2.;
+		double w = 0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) + 0.08 * cos(4 * M_PI * i / (n - 1));
+		d->taps[i] = w * (x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x));
+		sum += d->taps[i];
+	}
+	for(i = 0; i < n; i++)
+		d->taps[i] /= sum;
+
+	reset_decimator(d);
+}
+
+void reset_decimator(struct decimator *d)
+{
+	if(d->factor == 1) return;
+	memset(d->buff, 0, (d->taps_count - 1) * sizeof(float));
+	d->fill = d->taps_count - 1;
+	d->pos = d->factor - 1; // The output is aligned to the last input of each group of factor
+}
+
+/* y[i] += h * x[i], kept apart so that the compiler vectorizes it */
+static void axpy(float *restrict y, float h, const float *restrict x, int count)
+{
+	int i;
+	for(i = 0; i < count; i++)
+		y[i] += h * x[i];
+}
+
+/* Compute count outputs from x. The input is split in its factor phases, then each
+   polyphase branch is accumulated with contiguous multiply-adds over all the outputs. */
+static void decimate_block(struct decimator *d, const float *x, float *y, int count)
+{
+	int f = d->factor;
+	int len = count + d->taps_count / f - 1; // Samples in each phase
+	int i, q, r;
+	for(r = 0; r < f; r++) {
+		float *plane = d->planes + r * len;
+		for(i = 0; i < len; i++)
+			plane[i] = x[i*f + r];
+	}
+	memset(y, 0, count * sizeof(float));
+	for(r = 0; r < f; r++)
+		for(q = 0; q < d->taps_count / f; q++) // The taps are symmetric
+			axpy(y, d->taps[q*f + r], d->planes + r * len + q, count);
+}
+
+/* Decimate count samples from in to out, which may coincide with in.
+   The state carries over between calls. Returns the number of output samples. */
+int run_decimator(struct decimator *d, const float *in, int count, float *out)
+{
+	if(d->factor == 1) {
+		if(out != in) memmove(out, in, count * sizeof(float));
+		return count;
+	}
+	int i = 0, n = 0;
+	while(i < count) {
+		int c = d->taps_count - 1 + DECIMATOR_BLOCK - d->fill;
+		if(c > count - i) c = count - i;
+		memcpy(d->buff + d->fill, in + i, c * sizeof(float));
+		d->fill += c;
+		i += c;
+		if(d->pos + d->taps_count <= d->fill) {
+			int m = (d->fill - d->taps_count - d->pos) / d->factor + 1;
+			decimate_block(d, d->buff + d->pos, out + n, m);
+			n += m;
+			d->pos += m * d->factor;
+		}
+		memmove(d->buff, d->buff + d->pos, (d->fill - d->pos) * sizeof(float));
+		d->fill -= d->pos;
+		d->pos = 0;
+	}
+	return n;
+}
+
+/* sample_rate is the rate at the output of the input decimator, size the length of its ring */
+void setup_front_end(struct front_end *fe, int sample_rate, int input_decimation, int env_decimation, int precision, int size)
+{
+	fe->precision = precision;
+	make_hp(&fe->hpf,(double)FILTER_CUTOFF/sample_rate);
+	make_lp(&fe->lpf,(double)FILTER_CUTOFF/sample_rate);
+	setup_decimator(&fe->in_dec, input_decimation);
+	setup_decimator(&fe->dec, env_decimation);
+	setup_suppressor(&fe->sup, sample_rate, size);
+	reset_front_end(fe, 0);
+}
+
+/* pos is the absolute position of the next output sample */
+void reset_front_end(struct front_end *fe, uint64_t pos)
+{
+	fe->hpf_z[0] = fe->hpf_z[1] = 0;
+	fe->lpf_z[0] = fe->lpf_z[1] = 0;
+	reset_decimator(&fe->in_dec);
+	reset_suppressor(&fe->sup, pos);
+}
+
+/* Streaming part of the filter chain, it runs once on each newly captured sample.
+   The states are kept in fe, so that consecutive calls join seamlessly.
+   count must be a multiple of the input decimation, returns the number of output samples.
+   In precision mode, energy receives the output of the noise suppressor. */
+int run_front_end(struct front_end *fe, const float *in, int count, float *out, float *energy)
+{
+	int size = run_decimator(&fe->in_dec, in, count, out);
+	filter_block(&fe->hpf, fe->hpf_z, out, out, size);
+	if(fe->precision)
+		run_suppressor(&fe->sup, out, size, energy);
+	else {
+		int i;
+		for(i=0; i < size; i++)
+			out[i] = fabs(out[i]);
+		filter_block(&fe->lpf, fe->lpf_z, out, out, size);
+	}
+	return size;
+}
+
+/* The FFT plans are shared by all the steps, and by whatever else is running an analysis:
+   they are cached by size and kind, and run on the arrays of each step through the new-array
+   execute functions. All the arrays come from fftwf_malloc(), so their alignment matches. */
+enum { FFT_R2C, FFT_C2R, FFT_FORWARD, FFT_BACKWARD };
+
+struct cached_plan {
+	fftwf_plan plan; // NULL if the slot is free
+	int size, kind;
+	int measured; // Made with FFTW_MEASURE, kept in the cache even when unused
+	int users;
+};
+
+/* The FFTW planner is not thread safe, nor is the cache. The background planner holds
+   planner_mutex while it measures, so the other threads only ever try to take it. */
+static GMutex planner_mutex;
+static struct cached_plan plan_cache[PLAN_CACHE];
+static char *wisdom_file; // NULL if the plans are not to be measured
+static gint wisdom_generation; // Bumped whenever the background planner adds to the cache
+static gint plans_wanted; // An analysis thread found the planner busy, see refresh_plans()
+static GThreadPool *planner_pool;
+
+/* The plans are made on arrays of their own, FFTW_MEASURE overwrites them */
+static fftwf_plan new_plan(int size, int kind, unsigned flags)
+{
+	void *in = fftwf_malloc(size * sizeof(fftwf_complex));
+	void *out = fftwf_malloc(size * sizeof(fftwf_complex));
+	fftwf_plan p;
+	switch(kind) {
+	case FFT_R2C:
+		p = fftwf_plan_dft_r2c_1d(size, in, out, flags);
+		break;
+	case FFT_C2R:
+		p = fftwf_plan_dft_c2r_1d(size, in, out, flags);
+		break;
+	default:
+		p = fftwf_plan_dft_1d(size, in, out, kind == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD, flags);
+	}
+	fftwf_free(in);
+	fftwf_free(out);
+	return p;
+}
+
+static struct cached_plan *cache_plan(fftwf_plan p, int size, int kind, int measured)
+{
+	struct cached_plan *c;
+	for(c = plan_cache; c < plan_cache + PLAN_CACHE; c++)
+		if(!c->plan) {
+			c->plan = p;
+			c->size = size;
+			c->kind = kind;
+			c->measured = measured;
+			c->users = 0;
+			return c;
+		}
+	return NULL;
+}
+
+static struct cached_plan *find_plan(int size, int kind)
+{
+	struct cached_plan *c, *found = NULL;
+	for(c = plan_cache; c < plan_cache + PLAN_CACHE; c++)
+		if(c->plan && c->size == size && c->kind == kind && (!found || c->measured))
+			found = c;
+	return found;
+}
+
+static void put_plans(struct processing_buffers *b);
+
+/* Work for planner_pool, one plan to measure or the plans of a step to give back */
+struct planner_job {
+	int size, kind;
+	struct processing_buffers *step; // NULL for a measurement
+};
+
+/* Runs in planner_pool: measure a plan, add it to the cache and save the wisdom.
+   It may take seconds for the longest steps. The jobs run one at a time, in order. */
+static void run_planner_job(gpointer data, gpointer user_data)
+{
+	struct planner_job *job = data;
+	if(job->step) {
+		g_mutex_lock(&planner_mutex);
+		put_plans(job->step);
+		g_mutex_unlock(&planner_mutex);
+		free(job->step);
+		free(job);
+		return;
+	}
+	// An analysis thread waiting for its plans goes first, it retries once per cycle
+	int i;
+	for(i = 0; i < 2 * COMPUTE_INTERVAL && g_atomic_int_get(&plans_wanted); i++)
+		g_usleep(1000);
+	g_mutex_lock(&planner_mutex);
+	struct cached_plan *c = find_plan(job->size, job->kind);
+	if(!c || !c->measured) {
+		fftwf_plan p = new_plan(job->size, job->kind, FFTW_MEASURE);
+		if(!cache_plan(p, job->size, job->kind, 1))
+			fftwf_destroy_plan(p);
+		if(!fftwf_export_wisdom_to_filename(wisdom_file))
+			debug("could not save the FFT wisdom to %s\n", wisdom_file);
+	}
+	g_mutex_unlock(&planner_mutex);
+	g_atomic_int_inc(&wisdom_generation);
+	free(job);
+}
+
+/* A plan from the cache, measured if possible. Without wisdom for it, an estimated plan is
+   used while it is measured in the background. The caller holds planner_mutex. */
+static fftwf_plan get_plan(int size, int kind, int *measured)
+{
+	struct cached_plan *c = find_plan(size, kind);
+	if(!c) {
+		fftwf_plan p = new_plan(size, kind, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+		int m = p != NULL;
+		if(!m) {
+			p = new_plan(size, kind, FFTW_ESTIMATE);
+			if(wisdom_file) {
+				if(!planner_pool)
+					planner_pool = g_thread_pool_new(run_planner_job, NULL, 1, FALSE, NULL);
+				struct planner_job *job = malloc(sizeof(struct planner_job));
+				job->size = size;
+				job->kind = kind;
+				job->step = NULL;
+				g_thread_pool_push(planner_pool, job, NULL);
+			}
+		}
+		c = cache_plan(p, size, kind, m);
+		if(!c) { // The cache is full, the plan is not shared
+			*measured = m;
+			return p;
+		}
+	}
+	c->users++;
+	*measured = c->measured;
+	return c->plan;
+}
+
+/* Estimated plans go as soon as nobody uses them. The caller holds planner_mutex. */
+static void put_plan(fftwf_plan p)
+{
+	struct cached_plan *c;
+	for(c = plan_cache; c < plan_cache + PLAN_CACHE; c++)
+		if(c->plan == p) {
+			if(--c->users == 0 && !c->measured) {
+				fftwf_destroy_plan(p);
+				c->plan = NULL;
+			}
+			return;
+		}
+	fftwf_destroy_plan(p);
+}
+
+/* The caller holds planner_mutex */
+static void get_plans(struct processing_buffers *b)
+{
+	int m[6];
+	b->plan_a = get_plan(2 * b->sample_count, FFT_R2C, &m[0]);
+	b->plan_b = get_plan(2 * b->sample_count, FFT_C2R, &m[1]);
+	b->plan_c = get_plan(2 * b->sample_rate, FFT_R2C, &m[2]);
+	b->plan_d = get_plan(2 * b->sample_rate, FFT_C2R, &m[3]);
+	b->plan_e = get_plan(b->event_size, FFT_FORWARD, &m[4]);
+	b->plan_f = get_plan(b->event_size, FFT_BACKWARD, &m[5]);
+	// Without a wisdom file nothing is measured, the estimated plans are final
+	b->measured = (m[0] && m[1] && m[2] && m[3] && m[4] && m[5]) || !wisdom_file;
+	b->wisdom_generation = g_atomic_int_get(&wisdom_generation);
+}
+
+/* The caller holds planner_mutex */
+static void put_plans(struct processing_buffers *b)
+{
+	put_plan(b->plan_a);
+	put_plan(b->plan_b);
+	put_plan(b->plan_c);
+	put_plan(b->plan_d);
+	put_plan(b->plan_e);
+	put_plan(b->plan_f);
+}
+
+/* Use the FFT wisdom in filename, and keep it there. Without wisdom for a plan, it is
+   measured in the background, meanwhile the steps run with an estimated one. */
+void load_wisdom(char *filename)
+{
+	g_mutex_lock(&planner_mutex);
+	if(!fftwf_import_wisdom_from_filename(filename))
+		debug("no FFT wisdom in %s\n", filename);
+	wisdom_file = g_strdup(filename);
+	g_mutex_unlock(&planner_mutex);
+}
+
+/* Place size bytes at *pos in the arena, or only count them if arena is NULL */
+static void *carve(char *arena, size_t *pos, size_t size)
+{
+	void *p = arena ? arena + *pos : NULL;
+	*pos += (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	return p;
 }
 
-void pb_destroy_clone(struct processing_buffers *p)
+/* Lay out all the arrays of a step in arena, returns the size it takes */
+static size_t layout_buffers(struct processing_buffers *b, char *arena)
 {
-	free(p->waveform);
+	size_t pos = 0;
+	int n = b->sample_count, sr = b->sample_rate, m = b->event_size;
+	b->samples = carve(arena, &pos, 2 * n * sizeof(float));
+	b->samples_sc = carve(arena, &pos, 2 * n * sizeof(float));
+	b->waveform = carve(arena, &pos, 2 * sr * sizeof(float));
+	b->waveform_sc = carve(arena, &pos, 2 * sr * sizeof(float));
+	b->fft = carve(arena, &pos, (n + 1) * sizeof(fftwf_complex));
+	b->sc_fft = carve(arena, &pos, (n + 1) * sizeof(fftwf_complex));
+	b->tic_c = carve(arena, &pos, m * sizeof(float));
+	b->toc_c = carve(arena, &pos, m * sizeof(float));
+	b->tic_fft = carve(arena, &pos, 2 * m * sizeof(fftwf_complex));
+	b->event_c = carve(arena, &pos, m * sizeof(fftwf_complex));
+	b->events = carve(arena, &pos, EVENTS_MAX * sizeof(uint64_t));
+	b->scratch = carve(arena, &pos, sr * sizeof(float));
+	b->work = carve(arena, &pos, (sr + 2) * sizeof(float));
+	b->located = carve(arena, &pos, EVENTS_MAX * sizeof(int));
+	b->fold = carve(arena, &pos, (n + 3 * sr) * sizeof(float));
 #ifdef DEBUG
-	free(p->debug);
+	b->debug = carve(arena, &pos, (n + 1) * sizeof(float));
 #endif
-	free(p);
+	return pos;
+}
+
+static void size_events(struct processing_buffers *b)
+{
+	// Room for the longest template, half of the longest period, plus the search window
+	int w = b->sample_rate / 4 + ceil(0.04 * b->sample_rate) + 2;
+	for(b->event_size = 1; b->event_size < w; b->event_size *= 2);
+}
+
+/* Bytes that setup_buffers() would allocate for a step */
+size_t buffers_size(int sample_rate, int sample_count)
+{
+	struct processing_buffers b;
+	b.sample_rate = sample_rate;
+	b.sample_count = sample_count;
+	size_events(&b);
+	return layout_buffers(&b, NULL);
+}
+
+/* Allocate a step for the sample_rate and sample_count set in b. All the arrays live in a
+   single arena, aligned for the FFT plans. The plans are got later by refresh_plans(). */
+void setup_buffers(struct processing_buffers *b)
+{
+	size_events(b);
+	b->arena_size = layout_buffers(b, NULL);
+	b->arena = fftwf_malloc(b->arena_size);
+	layout_buffers(b, b->arena);
+	debug("step of %d samples: %zu bytes\n", b->sample_count, b->arena_size);
+	b->plan_a = NULL;
+	b->measured = 0;
+	b->events[0] = 0;
+	b->ready = 0;
+	b->tracking = 0;
+}
+
+static int stale_plans(struct processing_buffers *b)
+{
+	return !b->plan_a || (!b->measured && b->wisdom_generation != g_atomic_int_get(&wisdom_generation));
+}
+
+/* Get the plans of the count steps in p, and switch to measured plans once the background
+   planner has got them. To be called between processing cycles, it does not wait for the
+   planner: returns 0 while some step has no plans yet. All the steps get their plans at
+   once, so the measurements they queue only start afterwards. */
+int refresh_plans(struct processing_buffers *p, int count)
+{
+	int i, stale = 0;
+	for(i = 0; i < count; i++)
+		stale |= stale_plans(&p[i]);
+	if(!stale)
+		return 1;
+	if(!g_mutex_trylock(&planner_mutex))
+		g_atomic_int_set(&plans_wanted, 1);
+	else {
+		g_atomic_int_set(&plans_wanted, 0);
+		for(i = 0; i < count; i++) {
+			if(!stale_plans(&p[i]))
+				continue;
+			struct processing_buffers old = p[i];
+			get_plans(&p[i]);
+			if(old.plan_a)
+				put_plans(&old);
+			if(p[i].measured)
+				debug("measured FFT plans for %d samples\n", p[i].sample_count);
+		}
+		g_mutex_unlock(&planner_mutex);
+	}
+	for(i = 0; i < count; i++)
+		if(!p[i].plan_a)
+			return 0;
+	return 1;
+}
+
+/* It does not wait for the planner either: while a measurement runs, the plans
+   are given back by the background planner after it */
+void destroy_buffers(struct processing_buffers *b)
+{
+	if(b->plan_a) {
+		int locked = g_mutex_trylock(&planner_mutex);
+		if(!locked && planner_pool) {
+			struct planner_job *job = malloc(sizeof(struct planner_job));
+			job->step = malloc(sizeof(struct processing_buffers));
+			*job->step = *b;
+			g_thread_pool_push(planner_pool, job, NULL);
+		} else {
+			if(!locked) // Nothing is measured, so it is only held briefly
+				g_mutex_lock(&planner_mutex);
+			put_plans(b);
+			g_mutex_unlock(&planner_mutex);
+		}
+	}
+	fftwf_free(b->arena);
+	b->arena = NULL;
 }
 
 float vmax(float *v, int a, int b, int *i_max)
@@ -145,54 +642,127 @@ float vmax(float *v, int a, int b, int *i_max)
 	return max;
 }
 
-void noise_suppressor(struct processing_buffers *p)
+/* Set up s for the given sample rate and ring size, s must be zeroed or previously set up */
+void setup_suppressor(struct suppressor *s, int sample_rate, int size)
+{
+	free(s->squares);
+	free(s->maxima);
+	s->window = sample_rate / 50;
+	s->step = sample_rate / 2;
+	s->blocks = size / s->step + 2; // Enough for any window in the ring
+	s->squares = malloc(s->window * sizeof(float));
+	s->maxima = malloc(s->blocks * sizeof(float));
+	reset_suppressor(s, 0);
+}
+
+/* pos is the absolute position of the next sample */
+void reset_suppressor(struct suppressor *s, uint64_t pos)
+{
+	memset(s->squares, 0, s->window * sizeof(float));
+	memset(s->maxima, 0, s->blocks * sizeof(float));
+	s->energy = 0;
+	s->k = 0;
+	s->block = pos / s->step;
+	s->fill = pos % s->step;
+}
+
+/* Streaming part of the noise suppressor: energy[i] is the energy of the window
+   ending at in[i], and the maximum of the energy is kept for each half second block.
+   The blocks are disjoint, so a running maximum per block is all it takes. */
+void run_suppressor(struct suppressor *s, const float *in, int count, float *energy)
 {
-	float *a = p->samples_sc;
-	float *b = p->samples_sc + p->sample_count;
-	int window = p->sample_rate / 50;
 	int i;
+	for(i = 0; i < count; i++) {
+		float a = in[i] * in[i];
+		s->energy += (double)a - s->squares[s->k];
+		s->squares[s->k] = a;
+		if(++s->k == s->window) s->k = 0;
+		energy[i] = s->energy;
+		float *max = s->maxima + s->block % s->blocks;
+		if(!s->fill || energy[i] > *max) *max = energy[i];
+		if(++s->fill == s->step) {
+			s->fill = 0;
+			s->block++;
+		}
+	}
+}
 
-	for(i = 0; i < p->sample_count; i++)
-		a[i] = p->samples[i] * p->samples[i];
+/* Zero the samples where the energy around them exceeds twice the median of the
+   half second maxima. samples and energy are the count values preceding the absolute
+   position end, and only the blocks whose maximum is over the threshold are scanned. */
+void noise_suppressor(struct suppressor *s, float *samples, const float *energy, int count, uint64_t end, float *scratch)
+{
+	if(end < count) return; // Not enough history yet
+	uint64_t start = end - count;
+	uint64_t b;
+	int i, j = 0;
+	for(b = (start + s->step - 1) / s->step; (b + 1) * s->step <= end; b++)
+		scratch[j++] = s->maxima[b % s->blocks];
+	if(!j) return;
+	float k = 2 * select_kth(scratch, j, j/2);
 
-	double r_av = 0;
-	for(i = 0; i < window; i++)
-		r_av += a[i];
-	for(i = 0;; i++) {
-		b[i] = r_av;
-		if(i + window == p->sample_count) break;
-		r_av += a[i + window] - a[i];
+	// energy[i] is centered on samples[i - half + 1], so the scan starts at the energy of
+	// the first sample: the head of the window is tested against the energy around it,
+	// history before start included, rather than clamped to the first full window.
+	int half = s->window / 2;
+	uint64_t from = start + half - 1;
+	for(b = from / s->step; b * s->step < end; b++) {
+		if(s->maxima[b % s->blocks] <= k) continue;
+		int e0 = (b * s->step > from ? b * s->step : from) - start;
+		int e1 = ((b + 1) * s->step < end ? (b + 1) * s->step : end) - start;
+		for(i = e0; i < e1; i++)
+			if(energy[i] > k) samples[i - half + 1] = 0;
 	}
+	if(energy[count - 1] > k) // The last samples take the latest energy
+		for(i = count - half + 1; i < count; i++)
+			samples[i] = 0;
+}
 
-	int m = p->sample_count - window + 1;
-	int step = p->sample_rate / 2;
-	int j = 0;
-	for(i = 0; i + step - 1 < m; i += step)
-		a[j++] = vmax(b, i, i+step, NULL);
-	qsort(a, j, sizeof(float), fl_cmp);
-	float k = a[j/2];
+/* Copy the spans of a ring view to out */
+static void copy_view(float *out, struct ring_view *v)
+{
+	memcpy(out, v->span[0], v->len[0] * sizeof(float));
+	if(v->len[1])
+		memcpy(out + v->len[0], v->span[1], v->len[1] * sizeof(float));
+}
 
-	for(i = 0; i < p->sample_count; i++) {
-		int j = i - window / 2;
-		j = j < 0 ? 0 : j > p->sample_count - window ? p->sample_count - window : j;
-		if(b[j] > 2*k) p->samples[i] = 0;
+/* The part of the filter chain that needs the whole window. It runs once per cycle
+   over the longest window, into out, and all the steps share the result.
+   energy is the output of the suppressor over the same samples, which precede end.
+   The envelope is then decimated to the analysis sample rate. */
+void prepare_envelope(struct front_end *fe, struct ring_view *v, struct ring_view *energy, uint64_t end, float *out, float *scratch)
+{
+	int count = v->len[0] + v->len[1];
+
+	copy_view(out, v);
+
+	if(fe->precision) {
+		int i;
+		copy_view(scratch, energy);
+		noise_suppressor(&fe->sup, out, scratch, count, end, scratch + count);
+
+		for(i=0; i < count; i++)
+			out[i] = fabs(out[i]);
+
+		float z[2] = {0, 0};
+		filter_long(&fe->lpf, z, out, out, count, scratch);
+	}
+
+	if(fe->dec.factor > 1) {
+		reset_decimator(&fe->dec);
+		run_decimator(&fe->dec, out, count, out);
 	}
 }
 
-void prepare_data(struct processing_buffers *b)
+void prepare_data(struct processing_buffers *b, struct ring_view *v)
 {
 	int i;
 
+	// The envelope has already been computed, this is the only copy
+	memcpy(b->samples, v->span[0], v->len[0] * sizeof(float));
+	if(v->len[1])
+		memcpy(b->samples + v->len[0], v->span[1], v->len[1] * sizeof(float));
 	memset(b->samples + b->sample_count, 0, b->sample_count * sizeof(float));
-	run_filter(b->hpf, b->samples, b->sample_count);
-#ifndef LIGHT
-	noise_suppressor(b);
-#endif
-
-	for(i=0; i < b->sample_count; i++)
-		b->samples[i] = fabs(b->samples[i]);
-
-	run_filter(b->lpf, b->samples, b->sample_count);
 
 	double average = 0;
 	for(i=0; i < b->sample_count; i++)
@@ -207,10 +777,10 @@ void prepare_data(struct processing_buffers *b)
 		b->samples[b->sample_count - i - 1] *= k;
 	}
 
-	fftwf_execute(b->plan_a);
+	fftwf_execute_dft_r2c(b->plan_a, b->samples, b->fft);
 	for(i=0; i < b->sample_count+1; i++)
 			b->sc_fft[i] = b->fft[i] * conj(b->fft[i]);
-	fftwf_execute(b->plan_b);
+	fftwf_execute_dft_c2r(b->plan_b, b->sc_fft, b->samples_sc);
 
 #ifdef DEBUG
 	for(i=0; i < b->sample_count+1; i++)
@@ -218,18 +788,16 @@ void prepare_data(struct processing_buffers *b)
 #endif
 }
 
-int peak_detector(float *buff, int a, int b)
+/* scratch must have room for b-a+1 values */
+int peak_detector(float *buff, float *scratch, int a, int b)
 {
 	int i_max;
 	double max = vmax(buff, a, b+1, &i_max);
 	if(max <= 0) return -1;
 
 	int i;
-	float v[b-a+1];
-	for(i=a; i<=b; i++)
-		v[i-a] = buff[i];
-	qsort(v, b-a+1, sizeof(float), fl_cmp);
-	float med = v[(b-a+1)/2];
+	memcpy(scratch, buff + a, (b-a+1) * sizeof(float));
+	float med = select_kth(scratch, b-a+1, (b-a+1)/2);
 
 	for(i=a+1; i<i_max; i++)
 		if(buff[i] <= med) break;
@@ -253,11 +821,19 @@ int peak_detector(float *buff, int a, int b)
 	return i_max;
 }
 
+/* Sub-sample position of the peak at i, from the parabola through it and its neighbours */
+double interpolate_peak(float *buff, int i)
+{
+	double a = buff[i-1], b = buff[i], c = buff[i+1];
+	double d = a - 2*b + c;
+	return d < 0 ? i + (a - c) / (2*d) : i;
+}
+
 double estimate_period(struct processing_buffers *p)
 {
 	int first_estimate;
 	vmax(p->samples_sc, p->sample_rate / 12, p->sample_rate, &first_estimate);
-	first_estimate = peak_detector(p->samples_sc,
+	first_estimate = peak_detector(p->samples_sc, p->scratch,
 			fmax(p->sample_rate / 12, first_estimate - p->sample_rate / 12),
 			first_estimate + p->sample_rate / 12);
 	if(first_estimate == -1) {
@@ -268,7 +844,7 @@ double estimate_period(struct processing_buffers *p)
 	int factor = 1;
 	int fct;
 	for(fct = 2; first_estimate / fct > p->sample_rate / 12; fct++) {
-		int new_estimate = peak_detector(p->samples_sc,
+		int new_estimate = peak_detector(p->samples_sc, p->scratch,
 					first_estimate / fct - p->sample_rate / 50,
 					first_estimate / fct + p->sample_rate / 50);
 		if(new_estimate > -1 && p->samples_sc[new_estimate] > 0.9 * p->samples_sc[first_estimate]) {
@@ -282,7 +858,7 @@ double estimate_period(struct processing_buffers *p)
 	if(max < 0.2 * p->samples_sc[estimate]) {
 		if(first_estimate * 2 / factor < p->sample_rate ) {
 			debug("double triggered\n");
-			return peak_detector(p->samples_sc,
+			return peak_detector(p->samples_sc, p->scratch,
 					first_estimate * 2 / factor - p->sample_rate / 50,
 					first_estimate * 2 / factor + p->sample_rate / 50);
 		} else {
@@ -296,10 +872,21 @@ int compute_period(struct processing_buffers *b, int bph)
 {
 	double estimate;
 	if(bph)
-		estimate = peak_detector(b->samples_sc,
+		estimate = peak_detector(b->samples_sc, b->scratch,
 				7200 * b->sample_rate / bph - b->sample_rate / 50,
 				7200 * b->sample_rate / bph + b->sample_rate / 50);
-	else
+	else if(b->tracking) {
+		// Look only near the period found in the previous cycle
+		int last = round(b->period);
+		estimate = peak_detector(b->samples_sc, b->scratch,
+				last - b->sample_rate / 50,
+				last + b->sample_rate / 50);
+		if(estimate == -1) {
+			debug("lost track of the period\n");
+			b->tracking = 0;
+			estimate = estimate_period(b);
+		}
+	} else
 		estimate = estimate_period(b);
 	if(estimate == -1) {
 		debug("failed to estimate period\n");
@@ -316,12 +903,12 @@ int compute_period(struct processing_buffers *b, int bph)
 		int sup = ceil(new_estimate * cycle + delta);
 		if(sup > b->sample_count * 2 / 3)
 			break;
-		new_estimate = peak_detector(b->samples_sc,inf,sup);
-		if(new_estimate == -1) {
+		int peak = peak_detector(b->samples_sc,b->scratch,inf,sup);
+		if(peak == -1) {
 			debug("cycle = %d peak not found\n",cycle);
 			return 1;
 		}
-		new_estimate /= cycle;
+		new_estimate = interpolate_peak(b->samples_sc,peak) / cycle;
 		if(new_estimate < estimate - delta || new_estimate > estimate + delta) {
 			debug("cycle = %d new_estimate = %f invalid peak\n",cycle,new_estimate/b->sample_rate);
 			return 1;
@@ -344,30 +931,112 @@ int compute_period(struct processing_buffers *b, int bph)
 	return 0;
 }
 
-float tmean(float *x, int n)
+/* a, b = min(a, b), max(a, b) for whole rows */
+static void minmax_rows(float *restrict a, float *restrict b, int count)
+{
+	int i;
+	for(i = 0; i < count; i++) {
+		float u = a[i], v = b[i];
+		a[i] = u < v ? u : v;
+		b[i] = u < v ? v : u;
+	}
+}
+
+/* Sort the columns of the 16 rows starting at x, with Batcher's odd-even merge network */
+static void sort16_columns(float *x, int stride, int count)
 {
-	if(n>16) {
-		qsort(x,16,sizeof(float),fl_cmp);
-		float t = x[12];
-		int i, c1 = 0, c2 = 0;
-		for(i = 0; i < n; i++) {
-			if(x[i] < t) c1++;
-			if(x[i] > t) c2++;
+	int p, k, j, i;
+	for(p = 1; p < 16; p <<= 1)
+		for(k = p; k >= 1; k >>= 1)
+			for(j = k % p; j + k < 16; j += 2*k)
+				for(i = 0; i < k && i + j + k < 16; i++)
+					if((i + j) / (2*p) == (i + j + k) / (2*p))
+						minmax_rows(x + (i+j) * stride, x + (i+j+k) * stride, count);
+}
+
+static void count_row(const float *restrict x, const float *restrict t,
+		float *restrict below, float *restrict above, float *restrict sum, int count)
+{
+	int i;
+	for(i = 0; i < count; i++) {
+		below[i] += x[i] < t[i];
+		above[i] += x[i] > t[i];
+		sum[i] += x[i] < t[i] ? x[i] : 0;
+	}
+}
+
+/* Position of the phase bin i in the first period */
+static double bin_start(struct processing_buffers *p, int i)
+{
+	double k = i + p->phase; // phase < period
+	return k < p->period ? k : k - p->period;
+}
+
+/* Robust average over the periods of each phase bin of the waveform.
+   The samples are laid out one period per row, so that all the bins are handled
+   at once by loops over whole rows. The 13th of the first 16 samples of each bin
+   is used as threshold, and the samples below it are averaged, provided that
+   they are 70% to 90% of the total. Otherwise the lowest 80% is averaged. */
+static void fold_waveform(struct processing_buffers *p)
+{
+	int bins = ceil(p->period);
+	float *rows = p->fold;
+	int i, j, full;
+
+	// Only the last row may be partial
+	for(j = 0;; j++) {
+		float *r = rows + j * bins;
+		int valid = 0;
+		for(i = 0; i < bins; i++) {
+			int n = round(bin_start(p, i) + j * p->period);
+			if(n < p->sample_count) {
+				r[i] = p->samples[n];
+				valid++;
+			}
 		}
-		double r = (double)c1/(c1+c2);
-		if(r < .9 && r > .7) {
-			double sum = 0;
-			for(i=0; i < n; i++)
-				if(x[i] < t) sum += x[i];
-			return sum/c1;
+		if(valid < bins) {
+			full = j;
+			break;
 		}
 	}
-	qsort(x,n,sizeof(float),fl_cmp);
-	int i;
-	double sum = 0;
-	for(i=0; i < n*4/5; i++)
-		sum += x[i];
-	return sum/(n*4/5);
+	int count = full + 1;
+
+	float *t = rows + 12 * bins;
+	float *below = rows + count * bins;
+	float *above = below + bins;
+	float *sum = above + bins;
+	int network = full >= 16;
+	if(network) {
+		sort16_columns(rows, bins, bins);
+		for(i = 0; i < bins; i++) {
+			below[i] = above[i] = sum[i] = 0;
+			if(round(bin_start(p, i) + full * p->period) >= p->sample_count)
+				rows[full * bins + i] = t[i]; // Counts neither way
+		}
+		for(j = 0; j < count; j++)
+			if(j != 12)
+				count_row(rows + j * bins, t, below, above, sum, bins);
+	}
+
+	for(i = 0; i < bins; i++) {
+		int n = full + (round(bin_start(p, i) + full * p->period) < p->sample_count);
+		if(network && n > 16) {
+			double r = below[i] / (below[i] + above[i]);
+			if(r < .9 && r > .7) {
+				p->waveform[i] = sum[i] / below[i];
+				continue;
+			}
+		}
+		float *x = p->scratch;
+		for(j = 0; j < n; j++)
+			x[j] = rows[j * bins + i];
+		int m = n * 4 / 5;
+		select_kth(x, n, m - 1); // The lowest m come first
+		double s = 0;
+		for(j = 0; j < m; j++)
+			s += x[j];
+		p->waveform[i] = s / m;
+	}
 }
 
 void prepare_waveform(struct processing_buffers *p)
@@ -394,30 +1063,19 @@ void prepare_waveform(struct processing_buffers *p)
 	for(i=0; i<2*p->sample_rate; i++)
 		p->waveform[i] = 0;
 
-	float bin[(int)ceil(1 + p->sample_count / p->period)];
-	for(i=0; i < p->period; i++) {
-		int j;
-		double k = fmod(i+p->phase,p->period);
-		for(j=0;;j++) {
-			int n = round(k+j*p->period);
-			if(n >= p->sample_count) break;
-			bin[j] = p->samples[n];
-		}
-		p->waveform[i] = tmean(bin,j);
-	}
+	fold_waveform(p);
 
 	int step = ceil(p->period / 100);
 	for(i=0; i * step < p->period; i++)
 		p->waveform_sc[i] = p->waveform[i * step];
-	qsort(p->waveform_sc,i,sizeof(float),fl_cmp);
-	double nl = p->waveform_sc[i/2];
+	double nl = select_kth(p->waveform_sc, i, i/2);
 	for(i=0; i<p->period; i++)
 		p->waveform[i] -= nl;
 
-	fftwf_execute(p->plan_c);
+	fftwf_execute_dft_r2c(p->plan_c, p->waveform, p->sc_fft);
 	for(i=0; i < p->sample_rate+1; i++)
 			p->sc_fft[i] = p->sc_fft[i] * conj(p->sc_fft[i]);
-	fftwf_execute(p->plan_d);
+	fftwf_execute_dft_c2r(p->plan_d, p->sc_fft, p->waveform_sc);
 }
 
 void smooth(float *in, float *out, int window, int size)
@@ -447,24 +1105,24 @@ void smooth(float *in, float *out, int window, int size)
 
 int compute_parameters(struct processing_buffers *p)
 {
-	int tic_to_toc = peak_detector(p->waveform_sc,
+	int tic_to_toc = peak_detector(p->waveform_sc, p->scratch,
 			floor(p->period/2)-p->sample_rate/50,
 			floor(p->period/2)+p->sample_rate/50);
 	if(tic_to_toc < 0) {
 		debug("beat error = ---\n");
 		return 1;
 	} else {
-		p->be = p->period/2 - tic_to_toc;
+		p->be = p->period/2 - interpolate_peak(p->waveform_sc,tic_to_toc);
 		debug("beat error = %.1f\n",fabs(p->be)*1000/p->sample_rate);
 	}
 
 	int wf_size = ceil(p->period);
-	float fold_wf[wf_size - tic_to_toc];
+	float *fold_wf = p->work;
 	int i;
 	for(i = 0; i < wf_size - tic_to_toc; i++)
 		fold_wf[i] = p->waveform[i] + p->waveform[i+tic_to_toc];
 	int window = p->sample_rate / 2000;
-	float smooth_wf[wf_size - tic_to_toc - window];
+	float *smooth_wf = p->work + wf_size;
 	smooth(fold_wf, smooth_wf, window, wf_size - tic_to_toc);
 	int max_i;
 	float max = vmax(smooth_wf, 0, wf_size - tic_to_toc - window, &max_i);
@@ -494,26 +1152,62 @@ int compute_parameters(struct processing_buffers *p)
 	return 0;
 }
 
-void do_locate_events(int *events, struct processing_buffers *p, float *waveform, int last, int offset, int count)
+/* Correlate the samples with the first half period of the tic and toc waveforms, only
+   within 20ms of each predicted event. The tic and toc go together in the real and
+   imaginary parts of a single complex FFT correlation of event_size samples, they are
+   told apart in the frequency domain. */
+void do_locate_events(int *events, struct processing_buffers *p, float **waveform, int *last, int *offset, int count)
 {
-	int i;
-	memset(p->tic_wf, 0, 2 * p->sample_count * sizeof(float));
-	for(i=0; i<floor(p->period)/2; i++)
-		p->tic_wf[i] = waveform[i];
-
-	fftwf_execute(p->plan_e);
-	for(i=0; i < p->sample_count+1; i++)
-			p->sc_fft[i] = p->fft[i] * conj(p->tic_fft[i]);
-	fftwf_execute(p->plan_f);
+	int i,j,k;
+	int n = p->event_size;
+	int len = floor(p->period)/2;
+	for(i=0; i<n; i++)
+		p->event_c[i] = i < len ? waveform[0][i] + I * waveform[1][i] : 0;
+	fftwf_execute_dft(p->plan_e, p->event_c, p->tic_fft);
+	// Split into the conjugate spectra of the two templates, in tic_fft[0..n) and tic_fft[n..2n)
+	fftwf_complex *tic_t = p->tic_fft, *toc_t = p->tic_fft + n;
+	for(j=0; j <= n/2; j++) {
+		int m = (n - j) % n;
+		fftwf_complex x = tic_t[j], y = tic_t[m];
+		tic_t[j] = (conj(x) + y) / 2;
+		tic_t[m] = (conj(y) + x) / 2;
+		toc_t[j] = I * (conj(x) - y) / 2;
+		toc_t[m] = I * (conj(y) - x) / 2;
+	}
 
 	for(i=0; i<count; i++) {
-		int a = round(last - offset - i*p->period - 0.02*p->sample_rate);
-		int b = round(last - offset - i*p->period + 0.02*p->sample_rate);
-		if(a < 0 || b >= p->sample_count)
-			events[i] = -1;
-		else {
-			int peak = peak_detector(p->tic_c,a,b);
-			events[i] = peak >= 0 ? offset + peak : -1;
+		int a[2], b[2], ok[2];
+		for(k=0; k<2; k++) {
+			a[k] = round(last[k] - offset[k] - i*p->period - 0.02*p->sample_rate);
+			b[k] = round(last[k] - offset[k] - i*p->period + 0.02*p->sample_rate);
+			ok[k] = a[k] >= 0 && b[k] < p->sample_count;
+		}
+		events[i] = events[count+i] = -1;
+		if(!ok[0] && !ok[1])
+			continue;
+		for(j=0; j<n; j++) {
+			float re = ok[0] && a[0] + j < p->sample_count ? p->samples[a[0] + j] : 0;
+			float im = ok[1] && a[1] + j < p->sample_count ? p->samples[a[1] + j] : 0;
+			p->event_c[j] = re + I * im;
+		}
+		fftwf_execute_dft(p->plan_e, p->event_c, p->sc_fft);
+		fftwf_complex *x = p->sc_fft;
+		for(j=0; j <= n/2; j++) {
+			int m = (n - j) % n;
+			fftwf_complex tic_j = (x[j] + conj(x[m])) / 2, tic_m = (x[m] + conj(x[j])) / 2;
+			fftwf_complex toc_j = -I * (x[j] - conj(x[m])) / 2, toc_m = -I * (x[m] - conj(x[j])) / 2;
+			x[j] = tic_j * tic_t[j] + I * toc_j * toc_t[j];
+			x[m] = tic_m * tic_t[m] + I * toc_m * toc_t[m];
+		}
+		fftwf_execute_dft(p->plan_f, p->sc_fft, p->event_c);
+		// event_c[j] is the correlation at a+j, not wrapped around for j <= n - len
+		for(k=0; k<2; k++) {
+			if(!ok[k]) continue;
+			float *c = k ? p->toc_c : p->tic_c;
+			for(j=0; j <= b[k] - a[k]; j++)
+				c[j] = k ? cimag(p->event_c[j]) : creal(p->event_c[j]);
+			int peak = peak_detector(c,p->scratch,0,b[k]-a[k]);
+			events[k*count+i] = peak >= 0 ? offset[k] + a[k] + peak : -1;
 		}
 	}
 }
@@ -526,13 +1220,18 @@ void locate_events(struct processing_buffers *p)
 		return;
 	}
 
-	int events[2*count];
+	int *events = p->located;
 	int half = p->tic < p->period/2 ? 0 : round(p->period / 2);
-	int offset = p->tic - half;
-	do_locate_events(events, p, p->waveform + half, (int)(p->last_tic + p->sample_count - p->timestamp), offset, count);
+	float *waveform[2] = {p->waveform + half};
+	int offset[2] = {p->tic - half};
 	half = p->toc < p->period/2 ? 0 : round(p->period / 2);
-	offset = p->toc - half;
-	do_locate_events(events+count, p, p->waveform + half, (int)(p->last_toc + p->sample_count - p->timestamp), offset, count);
+	waveform[1] = p->waveform + half;
+	offset[1] = p->toc - half;
+	int last[2] = {
+		(int)(p->last_tic + p->sample_count - p->timestamp),
+		(int)(p->last_toc + p->sample_count - p->timestamp)
+	};
+	do_locate_events(events, p, waveform, last, offset, count);
 	qsort(events, 2*count, sizeof(int), int_cmp);
 
 	int i,j;
@@ -554,7 +1253,7 @@ void compute_amplitude(struct processing_buffers *p)
 	int window = p->sample_rate / 1000;
 	for(i = 0; i < window; i++)
 		p->waveform[i + wf_size] = p->waveform[i];
-	float smooth_wf[wf_size];
+	float *smooth_wf = p->work;
 	smooth(p->waveform, smooth_wf, window, wf_size + window);
 
 	double max = 0;
@@ -590,20 +1289,81 @@ void compute_amplitude(struct processing_buffers *p)
 	}
 }
 
-void process(struct processing_buffers *p, int bph)
+void process(struct processing_buffers *p, struct ring_view *v, int bph)
 {
-	prepare_data(p);
+	prepare_data(p,v);
 	p->ready = !compute_period(p,bph);
 	if(!p->ready) {
 		debug("abort after compute_period()\n");
+		p->tracking = 0;
 		return;
 	}
 	prepare_waveform(p);
 	p->ready = !compute_parameters(p);
 	if(!p->ready) {
 		debug("abort after compute_parameters()\n");
+		p->tracking = 0;
 		return;
 	}
 	locate_events(p);
 	compute_amplitude(p);
+	p->tracking = !bph; // Locked, the next cycle only has to follow the period
+}
+
+/* Beat by beat estimate of period and beat error, from the events located by the step p.
+   It is a steady state Kalman (alpha-beta) filter: each beat is predicted from the grid
+   of the previous ones, and the residual corrects phase, beat interval and beat error.
+   The tracker is seeded from the step, and again whenever the two disagree by more than
+   their sigmas allow. */
+void track_beats(struct beat_tracker *t, struct processing_buffers *p)
+{
+	double alpha = TRACKER_ALPHA;
+	double beta = alpha * alpha / (2 - alpha); // Critically damped
+	double gamma = alpha / 2;
+	int i;
+
+	if(!t->locked || fabs(2 * t->h - p->period) > TRACKER_RESEED * hypot(p->sigma, t->sigma)) {
+		double tic_to_toc = fmod(p->toc - p->tic + p->period, p->period);
+		t->h = p->period / 2;
+		t->be = t->h - tic_to_toc;
+		t->tic = 1;
+		t->grid = p->last_tic - t->be / 2;
+		t->last = p->last_tic;
+		t->var = pow(TRACKER_GATE * p->sample_rate / 2, 2);
+		t->misses = 0;
+		t->locked = 1;
+		debug("tracker seeded\n");
+	}
+
+	for(i = 0; i < EVENTS_MAX && p->events[i]; i++) {
+		uint64_t e = p->events[i];
+		if(e <= t->last) continue;
+		int n = round((e - t->grid) / t->h); // Beats since the last one
+		if(n < 1) continue;
+		int tic = n % 2 ? !t->tic : t->tic;
+		double s = tic ? .5 : -.5;
+		double base = t->grid + n * t->h;
+		double r = e - (base + s * t->be);
+		t->last = e;
+		if(fabs(r) > TRACKER_GATE * p->sample_rate) {
+			debug("tracker residual %f discarded\n", r);
+			if(++t->misses > TRACKER_MISSES) {
+				t->locked = 0;
+				break;
+			}
+			continue;
+		}
+		t->misses = 0;
+		t->grid = base + alpha * r;
+		t->h += beta * r / n;
+		t->be += gamma * 2 * s * r;
+		t->tic = tic;
+		t->var += alpha * (r * r - t->var);
+	}
+
+	// Steady state deviation of the velocity of an alpha-beta filter
+	t->period = 2 * t->h;
+	t->sigma = 2 * sqrt(t->var) * beta * sqrt(2 / (alpha * (4 - 2*alpha - beta)));
+	// grid only moves on accepted beats, the events may have stopped or all been discarded
+	t->fresh = t->locked && p->timestamp < t->grid + TRACKER_FRESH * t->h;
 }
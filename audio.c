@@ -18,10 +18,60 @@
 
 #include "tg.h"
 #include <portaudio.h>
+#include <stdatomic.h>
 
-volatile float pa_buffers[2][PA_BUFF_SIZE]; // Buffers to store the audio sample data
-volatile int write_pointer = 0; // Current write position in the buffers
-volatile uint64_t timestamp = 0; // Running timestamp
+/* The buffer is a single producer (the PortAudio callback), multiple consumer ring.
+   The producer publishes the running timestamp with release semantics once per block,
+   after the samples are in place; the write position is always timestamp % pa_buff_size,
+   so a single acquire load gives readers a consistent (position, timestamp) pair.
+   The size is set at startup, to twice the longest window of the analysis. */
+static float *pa_buffer; // Buffer to store the audio sample data, merged to mono
+static int pa_buff_size;
+static _Atomic uint64_t timestamp = 0; // Running timestamp
+
+static double pa_sample_rate; // Actual capture rate, reported by PortAudio
+
+// The analysis pipeline, set by set_analysis_mode()
+static int precision = 1;
+static int input_decimation = 1; // Decimation at the input of the front end
+static int env_decimation = PRECISION_ENV_DECIMATION;
+
+/* The output of the front end, owned by the analysis thread. It is indexed by the
+   timestamp at the front end sample rate, and wraps over together with pa_buffer.
+   Only the first pa_buff_size / input_decimation samples are used. */
+static float *fe_buffer;
+static float *en_buffer; // Energy from the noise suppressor, in precision mode
+static uint64_t fe_timestamp = 0; // fe_buffer is filled up to here
+static struct front_end fe;
+static int fe_sample_rate = 0;
+
+/* The envelope of the longest window, of which the shorter windows are suffixes */
+static float *env_buffer; // pa_buff_size / 2 values
+static float *env_scratch; // pa_buff_size values
+
+static uint64_t last_tic = 0;
+
+/* The steps are independent of each other: all but the longest one are handed
+   to a pool of threads, while the analysis thread takes care of the longest */
+struct step_job {
+	struct processing_buffers *p;
+	struct ring_view v;
+	int bph;
+};
+
+static GThreadPool *step_pool = NULL;
+static GMutex step_mutex;
+static GCond step_cond;
+static int steps_pending; // Jobs handed to the pool and not yet finished
+
+/* Merge interleaved stereo frames into mono. Kept as a plain loop over
+   contiguous memory so that the compiler vectorizes it. */
+static void mix_channels(float *restrict out, const float *restrict in, unsigned long count)
+{
+	unsigned long i;
+	for(i = 0; i < count; i++)
+		out[i] = in[2*i] + in[2*i + 1];
+}
 
 /* Callback function that consume audio in response to requests from an active PortAudio stream */
 int paudio_callback(const void *input_buffer,
@@ -31,23 +81,43 @@ int paudio_callback(const void *input_buffer,
 			PaStreamCallbackFlags status_flags,
 			void *data)
 {
-	unsigned long i;
-    // Copy the sample data to pa_buffers[] (Mac mini gets 512 samples on each callback)
-	for(i=0; i < frame_count; i++) {
-		pa_buffers[0][write_pointer] = ((float *)input_buffer)[2*i];
-		pa_buffers[1][write_pointer] = ((float *)input_buffer)[2*i + 1];
-		if(write_pointer < PA_BUFF_SIZE - 1) write_pointer++;
-        else write_pointer = 0; // Wrap over when reaching the buffer end
-        timestamp++; // Increase timestamp for each frame TODO: Move outside loop?
-	}
+	const float *in = input_buffer;
+	uint64_t ts = atomic_load_explicit(&timestamp, memory_order_relaxed); // Only we write it
+	unsigned long wp = ts % pa_buff_size;
+	// Copy the sample data to pa_buffer[] (Mac mini gets 512 samples on each callback)
+	unsigned long n = frame_count < pa_buff_size - wp ? frame_count : pa_buff_size - wp;
+	mix_channels(pa_buffer + wp, in, n);
+	mix_channels(pa_buffer, in + 2*n, frame_count - n); // Wrap over when reaching the buffer end
+	atomic_store_explicit(&timestamp, ts + frame_count, memory_order_release);
 	return 0;
 }
 
-/* Set up PA to continuously sample audio and store in buffers */
-int start_portaudio(int *nominal_sample_rate, double *real_sample_rate, char* name)
+/* Read the running timestamp, all the samples before it are in place in pa_buffer */
+static uint64_t load_timestamp()
+{
+	return atomic_load_explicit(&timestamp, memory_order_acquire);
+}
+
+/* Current time in units of the analysis sample rate */
+uint64_t get_timestamp()
+{
+	return load_timestamp() / (input_decimation * env_decimation);
+}
+
+/* Set up PA to continuously sample audio and store in buffers,
+   for windows up to 2^longest_step seconds */
+int start_portaudio(char* name, int longest_step)
 {
 	PaStream *stream;
 
+	pa_buff_size = PA_SAMPLE_RATE << (longest_step + 1);
+	pa_buffer = calloc(pa_buff_size, sizeof(float));
+	fe_buffer = calloc(pa_buff_size, sizeof(float));
+	en_buffer = calloc(pa_buff_size, sizeof(float));
+	env_buffer = calloc(pa_buff_size / 2, sizeof(float));
+	env_scratch = calloc(pa_buff_size, sizeof(float));
+	debug("capture buffer: %d samples\n", pa_buff_size);
+
 	PaStream **x = malloc(sizeof(PaStream*));
 
 	PaError err = Pa_Initialize();
@@ -93,14 +163,7 @@ int start_portaudio(int *nominal_sample_rate, double *real_sample_rate, char* na
 		goto error;
 
 	const PaStreamInfo *info = Pa_GetStreamInfo(stream);
-#ifdef LIGHT
-	*nominal_sample_rate = PA_SAMPLE_RATE / 2;
-	*real_sample_rate = info->sampleRate / 2;
-#else
-	*nominal_sample_rate = PA_SAMPLE_RATE;
-    *real_sample_rate = info->sampleRate; // Actual sample rate, reported by PortAudio
-#endif
-	debug("sample rate: nominal = %d real = %f\n",*nominal_sample_rate,*real_sample_rate);
+	pa_sample_rate = info->sampleRate;
 
 	return 0;
 
@@ -109,48 +172,162 @@ error:
 	return 1;
 }
 
-int analyze_pa_data(struct processing_buffers *p, int bph, uint64_t events_from)
+/* Select the analysis pipeline, and return the sample rates it works at.
+   The ladder of windows gets the default of the mode if unset, and is cut to what
+   the capture buffer holds. The capture keeps running, but the analysis must be
+   stopped in the meantime. */
+void set_analysis_mode(int precision_mode, int decimation, struct ladder *ladder, int *nominal_sample_rate, double *real_sample_rate)
 {
-	static uint64_t last_tic = 0;
-    int wp = write_pointer; // Current write position in the buffers
-	uint64_t ts = timestamp;
-    if(wp < 0 || wp >= PA_BUFF_SIZE) wp = 0; // Sanity check for the buffer pointer
-#ifdef LIGHT
-    if(wp % 2) wp--; // Make sure pointer is even.
-	ts /= 2;
-#endif
+	if(decimation != 1 && decimation != 2 && decimation != 4) {
+		error("Invalid decimation factor %d", decimation);
+		decimation = DEFAULT_DECIMATION;
+	}
+	int first_step = precision_mode ? PRECISION_FIRST_STEP : LIGHT_FIRST_STEP;
+	if(ladder->first_step < 0)
+		ladder->first_step = first_step;
+	if(PA_SAMPLE_RATE << ladder->first_step > pa_buff_size / 2) {
+		error("Shortest window of %d s is too long", 1 << ladder->first_step);
+		ladder->first_step = first_step;
+	}
+	if(ladder->steps > MAX_STEPS) ladder->steps = MAX_STEPS;
+	while(ladder->steps > 1 && PA_SAMPLE_RATE << (ladder->first_step + ladder->steps - 1) > pa_buff_size / 2)
+		ladder->steps--;
+	if(ladder->steps < 1) ladder->steps = 1;
+	precision = precision_mode;
+	input_decimation = precision ? 1 : decimation;
+	env_decimation = precision ? PRECISION_ENV_DECIMATION : LIGHT_ENV_DECIMATION;
+
+	// The longest steps go first if the buffers would take more than ANALYSIS_MEMORY
+	int sample_rate = PA_SAMPLE_RATE / (input_decimation * env_decimation);
+	size_t total = 0;
 	int i;
-	for(i=0; i<NSTEPS; i++) {
-		int j,k;
-#ifdef LIGHT
-		k = wp - 2*p[i].sample_count;
-#else
-		k = wp - p[i].sample_count;
-#endif
-		if(k < 0) k += PA_BUFF_SIZE;
-		for(j=0; j < p[i].sample_count; j++) {
-            p[i].samples[j] = pa_buffers[0][k] + pa_buffers[1][k]; // Merge stereo into mono(?)
-#ifdef LIGHT
-			k += 2;
-#else
-			k++;
-#endif
-			if(k >= PA_BUFF_SIZE) k -= PA_BUFF_SIZE;
-		}
+	for(i = 0; i < ladder->steps; i++) {
+		total += buffers_size(sample_rate, sample_rate << (ladder->first_step + i));
+		if(total > ANALYSIS_MEMORY) break;
+	}
+	if(i < ladder->steps) {
+		error("Only %d windows fit in the memory for the analysis", i > 0 ? i : 1);
+		ladder->steps = i > 0 ? i : 1;
+	}
+
+	fe_sample_rate = 0; // Set up again on the next cycle
+	fe_timestamp = 0;
+	last_tic = 0; // Timestamps change unit
+
+	*nominal_sample_rate = sample_rate;
+	*real_sample_rate = pa_sample_rate / (input_decimation * env_decimation);
+	debug("sample rate: nominal = %d real = %f\n",*nominal_sample_rate,*real_sample_rate);
+}
+
+/* Run the front end on the samples captured since the last call, up to ts */
+static void update_front_end(uint64_t ts, int sample_rate)
+{
+	int size = pa_buff_size / input_decimation;
+	if(sample_rate != fe_sample_rate) {
+		setup_front_end(&fe, sample_rate, input_decimation, env_decimation, precision, size);
+		fe_sample_rate = sample_rate;
+		reset_front_end(&fe, fe_timestamp);
+	}
+	if(ts - fe_timestamp > size / 2) { // Fell behind the capture, restart
+		fe_timestamp = ts - size / 2;
+		reset_front_end(&fe, fe_timestamp);
+	}
+	while(fe_timestamp < ts) {
+		int k = fe_timestamp % size;
+		int n = ts - fe_timestamp < size - k ? ts - fe_timestamp : size - k;
+		run_front_end(&fe, pa_buffer + k * input_decimation, n * input_decimation, fe_buffer + k, en_buffer + k);
+		fe_timestamp += n;
+	}
+}
+
+/* Describe the count samples preceding position end of a ring as spans (no copy) */
+static void get_view(struct ring_view *v, float *buff, int size, int end, int count)
+{
+	int k = end - count;
+	if(k < 0) k += size;
+	v->span[0] = buff + k;
+	if(k + count <= size) {
+		v->len[0] = count;
+		v->span[1] = NULL;
+		v->len[1] = 0;
+	} else { // Wraps over the buffer end
+		v->len[0] = size - k;
+		v->span[1] = buff;
+		v->len[1] = count - v->len[0];
+	}
+}
+
+static void run_step(gpointer data, gpointer user_data)
+{
+	struct step_job *j = data;
+	process(j->p, &j->v, j->bph);
+	g_mutex_lock(&step_mutex);
+	if(--steps_pending == 0)
+		g_cond_signal(&step_cond);
+	g_mutex_unlock(&step_mutex);
+}
+
+/* Only the steps from first to steps - 1 are computed, the shorter ones keep their previous results.
+   Returns the number of leading steps that are ready. */
+int analyze_pa_data(struct processing_buffers *p, int steps, int bph, uint64_t events_from, int first)
+{
+	uint64_t ts = load_timestamp() / (input_decimation * env_decimation);
+	int fe_rate = p[0].sample_rate * env_decimation;
+	int fe_size = pa_buff_size / input_decimation;
+	update_front_end(ts * env_decimation, fe_rate);
+	int i;
+	struct ring_view v;
+	float *env;
+	int env_size, env_end;
+	if(!precision && env_decimation == 1) { // The front end has done all the filtering
+		env = fe_buffer;
+		env_size = fe_size;
+		env_end = ts % fe_size;
+	} else {
+		int max_count = p[steps-1].sample_count;
+		uint64_t end = ts * env_decimation;
+		struct ring_view e;
+		get_view(&v, fe_buffer, fe_size, end % fe_size, max_count * env_decimation);
+		get_view(&e, en_buffer, fe_size, end % fe_size, max_count * env_decimation);
+		prepare_envelope(&fe, &v, &e, end, env_buffer, env_scratch);
+		env = env_buffer;
+		env_size = max_count;
+		env_end = 0;
 	}
 	debug("\nSTART OF COMPUTATION CYCLE\n\n");
-	for(i=0; i<NSTEPS; i++) {
+	if(!step_pool) {
+		int threads = g_get_num_processors() - 1;
+		threads = threads < 1 ? 1 : threads > MAX_STEPS - 1 ? MAX_STEPS - 1 : threads;
+		step_pool = g_thread_pool_new(run_step, NULL, threads, FALSE, NULL);
+	}
+	struct step_job jobs[MAX_STEPS];
+	for(i=first; i<steps; i++) {
+		get_view(&jobs[i].v, env, env_size, env_end, p[i].sample_count);
+		jobs[i].p = &p[i];
+		jobs[i].bph = bph;
 		p[i].timestamp = ts;
 		p[i].last_tic = last_tic;
 		p[i].events_from = events_from;
-		process(&p[i],bph);
-		if( !p[i].ready ) break;
-		debug("step %d : %f +- %f\n",i,p[i].period/p[i].sample_rate,p[i].sigma/p[i].sample_rate);
 	}
-	if(i) {
+	steps_pending = steps - 1 - first;
+	for(i=first; i<steps-1; i++)
+		g_thread_pool_push(step_pool, &jobs[i], NULL);
+	process(&p[steps-1], &jobs[steps-1].v, bph);
+	g_mutex_lock(&step_mutex);
+	while(steps_pending)
+		g_cond_wait(&step_cond, &step_mutex);
+	g_mutex_unlock(&step_mutex);
+
+	// The result is valid up to the first step that isn't ready
+	for(i=0; i<steps && p[i].ready; i++)
+		debug("step %d : %f +- %f\n",i,p[i].period/p[i].sample_rate,p[i].sigma/p[i].sample_rate);
+	// The skipped steps are at most LADDER_INTERVAL cycles old, they count while the lock holds
+	if(first && !p[first].ready)
+		i = 0;
+	if(i > first) { // The skipped steps have an older last_tic
 		last_tic = p[i-1].last_tic;
 		debug("%f +- %f\n",p[i-1].period/p[i-1].sample_rate,p[i-1].sigma/p[i-1].sample_rate);
-	} else
+	} else if(!i)
 		debug("---\n");
 	return i;
 }
@@ -0,0 +1,293 @@
+/*
+    tg
+    Copyright (C) 2015 Marcello Mamino
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "tg.h"
+
+struct computer {
+	GThread *thread;
+	GMutex mutex;
+	GCond cond;
+
+	// Owned by the analysis thread
+	struct processing_buffers pb[MAX_STEPS];
+	int steps;
+	double sigma_target;
+	int locked; // Step being displayed, -1 while acquiring
+	int locked_bph;
+	int cycles; // Since the last run of the whole ladder of steps
+	struct beat_tracker tracker;
+
+	// Shared with the UI thread, protected by mutex
+	int bph;
+	uint64_t events_from;
+	int recompute;
+	int terminate;
+	struct snapshot *snapshots[SNAPSHOTS]; // Filled when unreferenced, immutable once published
+	struct snapshot *current; // Latest result, the computer holds a reference to it
+	int overruns; // Consecutive cycles that took longer than COMPUTE_INTERVAL
+};
+
+static struct snapshot *snapshot_new(int sample_rate, int sample_count)
+{
+	struct snapshot *s = malloc(sizeof(struct snapshot));
+	memset(s, 0, sizeof(struct snapshot));
+	s->pb.waveform = malloc(sample_rate * sizeof(float));
+	s->pb.events = malloc(EVENTS_MAX * sizeof(uint64_t));
+	s->pb.events[0] = 0;
+#ifdef DEBUG
+	s->pb.debug = malloc(sample_count * sizeof(float));
+#endif
+	return s;
+}
+
+static void snapshot_destroy(struct snapshot *s)
+{
+	free(s->pb.waveform);
+	free(s->pb.events);
+#ifdef DEBUG
+	free(s->pb.debug);
+#endif
+	free(s);
+}
+
+/* Copy the results of a processing step, the storage of s is reused */
+static void snapshot_fill(struct snapshot *s, struct processing_buffers *p)
+{
+	s->pb.sample_rate = p->sample_rate;
+	s->pb.sample_count = p->sample_count;
+	memcpy(s->pb.waveform, p->waveform, p->sample_rate * sizeof(float));
+	memcpy(s->pb.events, p->events, EVENTS_MAX * sizeof(uint64_t));
+#ifdef DEBUG
+	memcpy(s->pb.debug, p->debug, p->sample_count * sizeof(float));
+#endif
+	s->pb.period = p->period;
+	s->pb.sigma = p->sigma;
+	s->pb.be = p->be;
+	s->pb.waveform_max = p->waveform_max;
+	s->pb.tic_pulse = p->tic_pulse;
+	s->pb.toc_pulse = p->toc_pulse;
+	s->pb.tic = p->tic;
+	s->pb.toc = p->toc;
+	s->pb.ready = p->ready;
+	s->pb.timestamp = p->timestamp;
+	s->has_data = 1;
+}
+
+static void snapshot_copy(struct snapshot *dst, struct snapshot *src)
+{
+	if(src->has_data) snapshot_fill(dst, &src->pb);
+	dst->has_data = src->has_data;
+	dst->is_old = src->is_old;
+	dst->signal = src->signal;
+	dst->tracker = src->tracker;
+}
+
+/* A snapshot nobody is looking at, to be filled by the analysis thread */
+static struct snapshot *free_snapshot(struct computer *c)
+{
+	struct snapshot *s = NULL;
+	int i;
+	g_mutex_lock(&c->mutex);
+	for(i = 0; i < SNAPSHOTS && !s; i++)
+		if(!c->snapshots[i]->refs)
+			s = c->snapshots[i];
+	g_mutex_unlock(&c->mutex);
+	return s;
+}
+
+static int plans_final(struct computer *c)
+{
+	int i;
+	for(i = 0; i < c->steps; i++)
+		if(!c->pb[i].measured)
+			return 0;
+	return 1;
+}
+
+/* Run one analysis cycle and fill s with the result to be displayed */
+static void compute(struct computer *c, int bph, uint64_t events_from, struct snapshot *s)
+{
+	struct processing_buffers *p = c->pb;
+	int i;
+	// Without the lock, or with another bph (forced or not), the last period is no guide
+	if(bph != c->locked_bph || c->locked < 0)
+		for(i = 0; i < c->steps; i++)
+			p[i].tracking = 0;
+	// Once locked, the steps shorter than the displayed one are only refreshed once in a while
+	int first = 0;
+	if(c->locked >= 0 && bph == c->locked_bph && ++c->cycles < LADDER_INTERVAL)
+		first = c->locked;
+	else
+		c->cycles = 0;
+	int signal = analyze_pa_data(p, c->steps, bph, events_from, first);
+	for(i = 0; i < c->steps && p[i].ready; i++);
+	for(i--; i >= 0 && p[i].sigma > p[i].period / 10000; i--);
+	// A shorter window that already meets the target follows changes sooner
+	int j;
+	for(j = first; j < i; j++)
+		if(p[j].sigma <= p[j].period * c->sigma_target) {
+			i = j;
+			break;
+		}
+	if(i < first) i = -1; // Lost the lock, the shorter steps are stale: acquire again
+	if(i >= 0) {
+		track_beats(&c->tracker, &p[i]);
+		snapshot_fill(s, &p[i]);
+		s->is_old = 0;
+		s->signal = signal;
+	} else {
+		// Keep showing the last good result, c->current is only replaced by this thread
+		snapshot_copy(s, c->current);
+		c->tracker.locked = 0;
+		c->tracker.fresh = 0;
+		s->is_old = 1;
+		s->signal = -signal;
+	}
+	s->tracker = c->tracker;
+	c->locked = i;
+	c->locked_bph = bph;
+}
+
+static gpointer computing_thread(gpointer data)
+{
+	struct computer *c = data;
+	gint64 next = g_get_monotonic_time();
+
+	g_mutex_lock(&c->mutex);
+	for(;;) {
+		while(!c->terminate && !c->recompute && g_get_monotonic_time() < next)
+			g_cond_wait_until(&c->cond, &c->mutex, next);
+		if(c->terminate) break;
+		int bph = c->bph;
+		uint64_t events_from = c->events_from;
+		c->recompute = 0;
+		g_mutex_unlock(&c->mutex);
+
+		next = g_get_monotonic_time() + COMPUTE_INTERVAL * 1000;
+		// Nothing is published until the steps have their FFT plans
+		struct snapshot *s = refresh_plans(c->pb, c->steps) ? free_snapshot(c) : NULL;
+		if(s) compute(c, bph, events_from, s);
+		// The estimated plans are slower, and the planner measuring them takes a core
+		int overrun = g_get_monotonic_time() > next && plans_final(c);
+
+		g_mutex_lock(&c->mutex);
+		if(s) {
+			c->current->refs--;
+			c->current = s;
+			s->refs = 1;
+		}
+		c->overruns = overrun ? c->overruns + 1 : 0;
+	}
+	g_mutex_unlock(&c->mutex);
+
+	return NULL;
+}
+
+/* The ladder must have been set up by set_analysis_mode() */
+struct computer *start_computer(int sample_rate, struct ladder *ladder, int bph)
+{
+	struct computer *c = malloc(sizeof(struct computer));
+	int i;
+	c->steps = ladder->steps;
+	c->sigma_target = ladder->sigma_target;
+	for(i = 0; i < c->steps; i++) {
+		c->pb[i].sample_rate = sample_rate;
+		c->pb[i].sample_count = sample_rate * (1 << (i + ladder->first_step));
+		setup_buffers(&c->pb[i]);
+		c->pb[i].period = -1;
+	}
+	int max_count = c->pb[c->steps-1].sample_count;
+	for(i = 0; i < SNAPSHOTS; i++)
+		c->snapshots[i] = snapshot_new(sample_rate, max_count);
+	c->current = c->snapshots[0];
+	c->current->refs = 1;
+	c->locked = -1;
+	c->locked_bph = bph;
+	c->tracker.locked = 0;
+	c->tracker.fresh = 0;
+	c->overruns = 0;
+	c->bph = bph;
+	c->events_from = 0;
+	c->recompute = 0;
+	c->terminate = 0;
+	g_mutex_init(&c->mutex);
+	g_cond_init(&c->cond);
+	c->thread = g_thread_new("computer", computing_thread, c);
+	return c;
+}
+
+void stop_computer(struct computer *c)
+{
+	g_mutex_lock(&c->mutex);
+	c->terminate = 1;
+	g_cond_signal(&c->cond);
+	g_mutex_unlock(&c->mutex);
+	g_thread_join(c->thread);
+
+	g_cond_clear(&c->cond);
+	g_mutex_clear(&c->mutex);
+	int i;
+	for(i = 0; i < c->steps; i++)
+		destroy_buffers(&c->pb[i]);
+	for(i = 0; i < SNAPSHOTS; i++)
+		snapshot_destroy(c->snapshots[i]);
+	free(c);
+}
+
+/* Change the bph and have the analysis rerun immediately */
+void computer_set_bph(struct computer *c, int bph)
+{
+	g_mutex_lock(&c->mutex);
+	c->bph = bph;
+	c->recompute = 1;
+	g_cond_signal(&c->cond);
+	g_mutex_unlock(&c->mutex);
+}
+
+void computer_set_events_from(struct computer *c, uint64_t events_from)
+{
+	g_mutex_lock(&c->mutex);
+	c->events_from = events_from;
+	g_mutex_unlock(&c->mutex);
+}
+
+/* The analysis has been missing its time budget for a while */
+int computer_overloaded(struct computer *c)
+{
+	g_mutex_lock(&c->mutex);
+	int r = c->overruns >= OVERLOAD_CYCLES;
+	g_mutex_unlock(&c->mutex);
+	return r;
+}
+
+/* The latest result, valid until released with computer_put_snapshot() */
+struct snapshot *computer_get_snapshot(struct computer *c)
+{
+	g_mutex_lock(&c->mutex);
+	struct snapshot *s = c->current;
+	s->refs++;
+	g_mutex_unlock(&c->mutex);
+	return s;
+}
+
+void computer_put_snapshot(struct computer *c, struct snapshot *s)
+{
+	g_mutex_lock(&c->mutex);
+	s->refs--;
+	g_mutex_unlock(&c->mutex);
+}
@@ -124,8 +124,10 @@ struct main_window {
 	GtkWidget *debug_drawing_area;
 #endif
 	
-	struct processing_buffers *bfs;
-	struct processing_buffers *old;
+	struct computer *cp;
+	struct snapshot *snst; // Latest results of the analysis thread, held until the next ones
+	int steps; // Of the ladder actually running, set_analysis_mode() may cut it
+	gint64 fallback_until; // Light mode while precision mode is overloaded, 0 if not
 	
 	int bph; // User selected bph. 0 if "Automatic"
 	int guessed_bph; // Calculated bph
@@ -139,7 +141,6 @@ struct main_window {
 	double trace_centering;
 	int trace_zoom;
 	
-	int signal;
 	struct Settings conf;
 };
 
@@ -178,36 +179,71 @@ int guess_bph(double period)
 /* Get data results and a flag indicating if it's current or old */
 struct processing_buffers *get_data(struct main_window *w, int *old)
 {
-	struct processing_buffers *p = w->bfs;
-	int i;
-	for (i=0; i<NSTEPS && p[i].ready; i++);
-	for (i--; i>=0 && p[i].sigma > p[i].period / 10000; i--);
-	if (i >= 0) {
-		// TODO: Can't we have one object kept alive instead of destroying/creating new ones every time?
-		if (w->old) pb_destroy_clone(w->old); // Remove the previous old data
-		w->old = pb_clone(&p[i]); // Store the current data as old
-		*old = 0;
-		return &p[i];
-	} else { // Mark as old
-		*old = 1;
-		return w->old;
-	}
+	*old = w->snst->is_old;
+	return w->snst->has_data ? &w->snst->pb : NULL;
 }
 
+/* Pick up the latest results from the analysis thread */
 void recompute(struct main_window *w)
 {
-	w->signal = analyze_pa_data(w->bfs, w->bph, w->events_from);
+	struct snapshot *s = computer_get_snapshot(w->cp);
+	computer_put_snapshot(w->cp, w->snst);
+	w->snst = s;
 	int old;
 	struct processing_buffers *p = get_data(w, &old);
-	if (old) w->signal = -w->signal;
 	if (p)
 		// If we have a bph set, use that for the "guess". Otherwise, calculate a guess.
 		w->guessed_bph = w->bph ? w->bph : guess_bph(p->period / w->sample_rate);
 }
 
-double get_rate(int bph, double sample_rate, struct processing_buffers *p)
+/* Room for the watch and one signal bar per step */
+static int icon_width(int steps)
+{
+	return OUTPUT_WINDOW_HEIGHT + 3*(OUTPUT_WINDOW_HEIGHT * 0.8 / (2*steps - 1));
+}
+
+/* The ladder of windows in the settings, the default of the mode is filled in later */
+static struct ladder settings_ladder(struct Settings *conf)
+{
+	struct ladder l;
+	l.first_step = conf->shortest_window ? round(log2(conf->shortest_window)) : -1;
+	l.steps = conf->windows;
+	l.sigma_target = conf->sigma_target;
+	return l;
+}
+
+/* (Re)start the analysis in the mode selected in the settings */
+void start_analysis(struct main_window *w)
+{
+	if (w->cp) {
+		computer_put_snapshot(w->cp, w->snst);
+		stop_computer(w->cp);
+	}
+	
+	int nominal_sr;
+	double real_sr;
+	struct ladder ladder = settings_ladder(&w->conf);
+	int precision_mode = w->conf.precision_mode && !w->fallback_until;
+	set_analysis_mode(precision_mode, w->conf.decimation, &ladder, &nominal_sr, &real_sr);
+	
+	if (w->cp && real_sr != w->sample_rate) {
+		// The timestamps are in units of the sample rate, convert the events already on the paperstrip
+		int i;
+		for (i=0; i<EVENTS_COUNT; i++)
+			w->events[i] = round(w->events[i] * real_sr / w->sample_rate);
+	}
+	
+	w->sample_rate = real_sr;
+	w->cp = start_computer(nominal_sr, &ladder, w->bph);
+	w->steps = ladder.steps;
+	if (w->icon_drawing_area)
+		gtk_widget_set_size_request(w->icon_drawing_area, icon_width(w->steps), OUTPUT_WINDOW_HEIGHT);
+	w->snst = computer_get_snapshot(w->cp);
+}
+
+double get_rate(int bph, double sample_rate, double period)
 {
-	return (7200/(bph*p->period / sample_rate) - 1)*24*3600;
+	return (7200/(bph*period / sample_rate) - 1)*24*3600;
 }
 
 /* Calculate the amplitude from the lift angle and audio signal */
@@ -264,6 +300,15 @@ void set_fps_label(struct main_window *w, double fps)
 /* Called 10 times/second to keep the UI updated */
 guint refresh_window(struct main_window *w)
 {
+	if (w->conf.precision_mode && !w->fallback_until && computer_overloaded(w->cp)) {
+		// The analysis can't keep up, fall back to light mode for a while, the setting is kept
+		w->fallback_until = g_get_monotonic_time() + OVERLOAD_COOLDOWN * G_USEC_PER_SEC;
+		start_analysis(w);
+	} else if (w->fallback_until && g_get_monotonic_time() > w->fallback_until) {
+		w->fallback_until = 0;
+		if (w->conf.precision_mode) start_analysis(w); // Try precision mode again
+	}
+	
 	recompute(w);
 	
 	int old;
@@ -273,9 +318,16 @@ guint refresh_window(struct main_window *w)
 		// Update the info labels
 		int bph = w->guessed_bph;
 		set_bph_label(w, bph);
-		int rate = round(get_rate(bph, w->sample_rate, p));
+		double period = p->period, be = p->be;
+		struct beat_tracker *t = &w->snst->tracker;
+		if (!old && t->fresh && t->sigma < p->sigma) {
+			// Beat by beat readings, they follow the watch faster than the window
+			period = t->period;
+			be = t->be;
+		}
+		int rate = round(get_rate(bph, w->sample_rate, period));
 		set_rate_label(w, rate);
-		double be = fabs(p->be) * 1000 / p->sample_rate;
+		be = fabs(be) * 1000 / p->sample_rate;
 		set_beaterror_label(w, be);
 		double amp = get_amplitude(w->la, p);
 		set_amplitude_label(w, amp);
@@ -538,7 +590,7 @@ gboolean icon_draw_event(GtkWidget *widget, cairo_t *cr, struct main_window *w)
 	// int width = gtk_widget_get_allocated_width(widget);
 	int height = gtk_widget_get_allocated_height(widget);
 	
-	int happy = !!w->signal;
+	int happy = !!w->snst->signal;
 	
 	// Watch hands
 	cairo_set_line_width(cr, 5);
@@ -555,10 +607,10 @@ gboolean icon_draw_event(GtkWidget *widget, cairo_t *cr, struct main_window *w)
 	cairo_arc(cr, height * 0.5, height * 0.5, height * 0.4, 0, 2*M_PI);
 	cairo_stroke(cr);
 	
-	const int l = height * 0.8 / (2*NSTEPS - 1);
+	const int l = height * 0.8 / (2*w->steps - 1);
 	int i;
 	cairo_set_line_width(cr, 1);
-	for (i = 0; i < w->signal; i++) {
+	for (i = 0; i < w->snst->signal; i++) {
 		cairo_move_to(cr, height + 0.5*l, height * 0.9 - 2*i*l);
 		cairo_line_to(cr, height + 1.5*l, height * 0.9 - 2*i*l);
 		cairo_line_to(cr, height + 1.5*l, height * 0.9 - (2*i+1)*l);
@@ -643,17 +695,11 @@ gboolean period_draw_event(GtkWidget *widget, cairo_t *cr, struct main_window *w
 	return FALSE;
 }
 
-extern volatile uint64_t timestamp;
-
 gboolean paperstrip_draw_event(GtkWidget *widget, cairo_t *cr, struct main_window *w)
 {
 	int i,old;
 	struct processing_buffers *p = get_data(w, &old);
-#ifdef LIGHT
-	uint64_t time = timestamp / 2;
-#else
-	uint64_t time = timestamp;
-#endif
+	uint64_t time = get_timestamp();
 	if (p && !old) {
 		uint64_t last = w->events[w->events_wp];
 		for (i=0; i<EVENTS_MAX && p->events[i]; i++)
@@ -666,6 +712,7 @@ gboolean paperstrip_draw_event(GtkWidget *widget, cairo_t *cr, struct main_windo
 	} else {
 		w->events_from = time;
 	}
+	computer_set_events_from(w->cp, w->events_from);
 	
 	cairo_init(cr);
 	
@@ -684,7 +731,7 @@ gboolean paperstrip_draw_event(GtkWidget *widget, cairo_t *cr, struct main_windo
 	cairo_set_line_width(cr, 1.3);
 	
 	if (p && w->events[w->events_wp]) {
-		double rate = get_rate(w->guessed_bph, w->sample_rate, p);
+		double rate = get_rate(w->guessed_bph, w->sample_rate, p->period);
 		double slope = - rate * strip_width * w->trace_zoom / (3600. * 24.);
 		if (slope <= 1 && slope >= -1) {
 			for (i=0; i<4; i++) {
@@ -840,6 +887,7 @@ void handle_bph_change(GtkComboBox *b, struct main_window *w)
 		if (*t || n < MIN_BPH || n > MAX_BPH) w->bph = 0;
 		else w->bph = w->guessed_bph = n;
 		g_free(s);
+		computer_set_bph(w->cp, w->bph);
 		recompute(w);
 		set_bph_label(w, w->guessed_bph);
 		redraw(w);
@@ -1110,10 +1158,16 @@ void show_preferences(GtkButton *button, struct main_window *w) {
 		// Save the dialog data in the settings variable and then save it out to disk
 		w->conf.audio_input = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(input));
 		w->conf.rate_adjustment = atof(gtk_entry_get_text(GTK_ENTRY(adjustment)));
+		gboolean precision_mode = w->conf.precision_mode;
 		w->conf.precision_mode = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(cpu));
 		w->conf.dark_theme = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(dark));
 		
 		save_settings(&w->conf);
+		
+		if (w->conf.precision_mode != precision_mode) {
+			w->fallback_until = 0; // The user's choice wins over the overload fallback
+			start_analysis(w); // Reallocate the buffers for the new mode
+		}
 	}
 	
 	// Get rid of the dialog
@@ -1123,8 +1177,6 @@ void show_preferences(GtkButton *button, struct main_window *w) {
 /* Set up the main window and populate with widgets */
 void init_main_window(struct main_window *w)
 {
-	w->signal = 0;
-	
 	w->events = malloc(EVENTS_COUNT * sizeof(uint64_t));
 	memset(w->events,0,EVENTS_COUNT * sizeof(uint64_t));
 	w->events_wp = 0;
@@ -1199,8 +1251,7 @@ void init_main_window(struct main_window *w)
 	
 	// Watch icon
 	w->icon_drawing_area = gtk_drawing_area_new();
-	int width = OUTPUT_WINDOW_HEIGHT + 3*(OUTPUT_WINDOW_HEIGHT * 0.8 / (2*NSTEPS - 1));
-	gtk_widget_set_size_request(w->icon_drawing_area, width, OUTPUT_WINDOW_HEIGHT);
+	gtk_widget_set_size_request(w->icon_drawing_area, icon_width(w->steps), OUTPUT_WINDOW_HEIGHT);
 	g_signal_connect(w->icon_drawing_area, "draw", G_CALLBACK(icon_draw_event), w);
 	gtk_container_add(GTK_CONTAINER(info_grid), w->icon_drawing_area); // Add to grid
 	
@@ -1369,24 +1420,19 @@ void activate (GtkApplication* app, gpointer user_data)
 	// Initialize the "global" w object
 	struct main_window w;
 	load_settings(&w.conf); // Load app settings
+	load_wisdom("tg.wisdom"); // FFT plans, kept next to tg.ini
 
-	// Initialize audio
-	int nominal_sr;
-	double real_sr;
-	if (start_portaudio(&nominal_sr, &real_sr, w.conf.audio_input)) return; // Bail out if we can't open audio.
-	
-	struct processing_buffers p[NSTEPS];
-	int i;
-	for (i=0; i < NSTEPS; i++) {
-		p[i].sample_rate = nominal_sr;
-		p[i].sample_count = nominal_sr * (1<<(i+FIRST_STEP));
-		setup_buffers(&p[i]);
-		p[i].period = -1;
-	}
-	
-	w.sample_rate = real_sr;
-	w.bfs = p;
-	w.old = NULL;
+	// Initialize audio, with room for the longest window of either mode
+	struct ladder ladder = settings_ladder(&w.conf);
+	int first_step = ladder.first_step >= 0 ? ladder.first_step : MAX(PRECISION_FIRST_STEP, LIGHT_FIRST_STEP);
+	int longest_step = MIN(first_step + ladder.steps - 1, MAX_LONGEST_STEP);
+	if (start_portaudio(w.conf.audio_input, longest_step)) return; // Bail out if we can't open audio.
+	
+	w.bph = 0;
+	w.cp = NULL;
+	w.icon_drawing_area = NULL;
+	w.fallback_until = 0;
+	start_analysis(&w);
 	w.window = gtk_application_window_new(app);
 	
 	gtk_window_set_default_size(GTK_WINDOW(w.window), w.conf.window_width, w.conf.window_height);
@@ -1415,6 +1461,9 @@ void activate (GtkApplication* app, gpointer user_data)
 	
 	// All GTK applications must have a gtk_main(). Control ends here and waits for an event to occur.
 	gtk_main(); // Runs the main loop until gtk_main_quit() is called.
+	
+	computer_put_snapshot(w.cp, w.snst);
+	stop_computer(w.cp);
 }
 
 /* PROGRAM START */
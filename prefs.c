@@ -25,6 +25,11 @@ void load_settings(struct Settings *conf) {
 	
 	GError *err = NULL;
 	key_file = g_key_file_new();
+	conf->precision_mode = TRUE;
+	conf->decimation = DEFAULT_DECIMATION;
+	conf->windows = DEFAULT_STEPS;
+	conf->shortest_window = 0;
+	conf->sigma_target = SIGMA_TARGET;
 	
 	if(!g_key_file_load_from_file(key_file,
 								  "tg.ini",
@@ -38,7 +43,19 @@ void load_settings(struct Settings *conf) {
 	else {
 		conf->audio_input = g_key_file_get_string(key_file, "main", "audio_input", &err);
 		conf->rate_adjustment = g_key_file_get_double(key_file, "main", "rate_adjustment", &err);
-		conf->precision_mode = g_key_file_get_boolean(key_file, "main", "precision_mode", &err);
+		if (g_key_file_has_key(key_file, "main", "precision_mode", NULL)) // Keep the default if missing
+			conf->precision_mode = g_key_file_get_boolean(key_file, "main", "precision_mode", NULL);
+		int decimation = g_key_file_get_integer(key_file, "main", "decimation", NULL);
+		if (decimation) conf->decimation = decimation; // Keep the default if missing
+		int windows = g_key_file_get_integer(key_file, "main", "windows", NULL);
+		if (windows >= 1 && windows <= MAX_STEPS) conf->windows = windows;
+		else if (windows) g_message("Invalid number of windows %d", windows);
+		int shortest = g_key_file_get_integer(key_file, "main", "shortest_window", NULL);
+		if (shortest >= 1 && shortest <= 1 << MAX_LONGEST_STEP && !(shortest & (shortest - 1)))
+			conf->shortest_window = shortest;
+		else if (shortest) g_message("Invalid shortest window %d s", shortest);
+		if (g_key_file_has_key(key_file, "main", "sigma_target", NULL))
+			conf->sigma_target = g_key_file_get_double(key_file, "main", "sigma_target", NULL);
 		conf->dark_theme = g_key_file_get_boolean(key_file, "ui", "dark_theme", &err);
 		conf->window_width = g_key_file_get_integer(key_file, "ui", "window_width", &err);
 		conf->window_height = g_key_file_get_integer(key_file, "ui", "window_height", &err);
@@ -50,6 +67,10 @@ void save_settings(struct Settings *conf) {
 	g_key_file_set_string(key_file, "main", "audio_input", conf->audio_input);
 	g_key_file_set_double(key_file, "main", "rate_adjustment", conf->rate_adjustment);
 	g_key_file_set_boolean(key_file, "main", "precision_mode", conf->precision_mode);
+	g_key_file_set_integer(key_file, "main", "decimation", conf->decimation);
+	g_key_file_set_integer(key_file, "main", "windows", conf->windows);
+	g_key_file_set_integer(key_file, "main", "shortest_window", conf->shortest_window);
+	g_key_file_set_double(key_file, "main", "sigma_target", conf->sigma_target);
 	g_key_file_set_boolean(key_file, "ui", "dark_theme", conf->dark_theme);
 	g_key_file_set_integer(key_file, "ui", "window_width", conf->window_width);
 	g_key_file_set_integer(key_file, "ui", "window_height", conf->window_height);
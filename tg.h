@@ -26,22 +26,43 @@
 #include "glib.h"
 
 #define FILTER_CUTOFF 3000
+#define DECIMATOR_TAPS 16 // FIR length, per unit of decimation factor
+#define DECIMATOR_BLOCK 4096
+#define FILTER_LANES 8 // Segments of a long block filtered side by side
+#define FILTER_SEGMENT 1024 // Shortest segment worth it
+#define FILTER_TILE 64
+#define PLAN_CACHE 64 // FFT plans of distinct size and kind
+#define ARENA_ALIGN 64 // Of the arrays in the arena of a step, enough for any SIMD
 
-#ifdef LIGHT
+#define TRACKER_ALPHA 0.2 // Gain of the beat tracker on the phase of each beat
+#define TRACKER_GATE 0.005 // s, beats further than this from the prediction are discarded
+#define TRACKER_MISSES 6 // Consecutive discarded beats before the tracker loses the lock
+#define TRACKER_RESEED 3 // Sigmas of disagreement with the step before the tracker is seeded again
+#define TRACKER_FRESH 10 // Beats since the last accepted one for the readings to be current
 
-#define NSTEPS 4
-#define FIRST_STEP 0
+#define COMPUTE_INTERVAL 100 // ms between two analysis cycles
+#define LADDER_INTERVAL 10 // Cycles between two runs of the steps shorter than the one displayed
+
+// Ladder of analysis windows, 2^first_step, 2^(first_step+1), ... seconds long
+#define MAX_STEPS 6
+#define DEFAULT_STEPS 4
+#define MAX_LONGEST_STEP 6 // The capture buffer holds twice the longest window
+#define ANALYSIS_MEMORY (64 << 20) // Bytes, cap on the buffers of all the steps
+#define SIGMA_TARGET 1e-5 // Relative, the shortest window within it is displayed
 #define PA_SAMPLE_RATE 44100
-#define PA_BUFF_SIZE (PA_SAMPLE_RATE << (NSTEPS + FIRST_STEP + 1))
 
-#else
+// Precision mode: noise suppression, the envelope is computed at full rate and then decimated
+#define PRECISION_FIRST_STEP 1
+#define PRECISION_ENV_DECIMATION 2
 
-#define NSTEPS 4
-#define FIRST_STEP 1
-#define PA_SAMPLE_RATE 44100
-#define PA_BUFF_SIZE (PA_SAMPLE_RATE << (NSTEPS + FIRST_STEP))
+// Light mode: the capture is decimated and the envelope is computed as the samples arrive
+#define LIGHT_FIRST_STEP 0
+#define LIGHT_ENV_DECIMATION 1
+#define DEFAULT_DECIMATION 2 // Of the captured audio, can be changed in the settings
 
-#endif
+#define SNAPSHOTS 3 // The published one, one still held by the UI, one being filled
+#define OVERLOAD_CYCLES 10 // Consecutive analysis cycles over COMPUTE_INTERVAL before falling back to light mode
+#define OVERLOAD_COOLDOWN 300 // s in light mode before precision mode is tried again
 
 #define OUTPUT_FONT 40
 #define OUTPUT_WINDOW_HEIGHT 70
@@ -71,44 +92,158 @@
 #endif
 
 /* algo.c */
+/* Biquad, run in single precision transposed direct form II */
 struct filter {
-	double a0,a1,a2,b1,b2;
+	float a0,a1,a2,b1,b2;
+};
+
+/* Anti-alias low pass FIR followed by downsampling, only the retained outputs are computed */
+struct decimator {
+	int factor;
+	int taps_count;
+	float *taps;
+	float *buff; // The last inputs, followed by room for a new block
+	float *planes; // Scratch space for the polyphase branches
+	int fill, pos; // Valid samples in buff, start of the next output window
+};
+
+/* Running energy of the signal and its maxima over half second blocks, see run_suppressor() */
+struct suppressor {
+	int window; // Of the energy
+	int step; // Length of the blocks
+	double energy;
+	float *squares; // Of the last window samples, circular
+	int k; // Oldest in squares
+	float *maxima; // For the last blocks, circular
+	int blocks; // Size of maxima
+	uint64_t block; // Absolute index of the current block
+	int fill; // Samples in the current block
+};
+
+/* Filters applied to the incoming samples as they arrive: the high pass filter,
+   plus rectification and low pass filter in light mode, or the streaming part of
+   the noise suppressor in precision mode */
+struct front_end {
+	int precision; // The rest of the chain runs on the whole window, after noise suppression
+	struct decimator in_dec; // Reduces the capture rate, selectable at runtime
+	struct filter hpf, lpf;
+	float hpf_z[2], lpf_z[2];
+	struct suppressor sup;
+	struct decimator dec; // Brings the envelope to the analysis sample rate
+};
+
+/* The samples to be analyzed, as at most two contiguous spans of a ring */
+struct ring_view {
+	const float *span[2];
+	int len[2];
 };
 
 struct processing_buffers {
+	// Scalars, read and written all through the processing
 	int sample_rate;
 	int sample_count;
-	float *samples, *samples_sc, *waveform, *waveform_sc, *tic_wf, *tic_c;
-	fftwf_complex *fft, *sc_fft, *tic_fft;
-	fftwf_plan plan_a, plan_b, plan_c, plan_d, plan_e, plan_f;
-	struct filter *hpf, *lpf;
 	double period,sigma,be,waveform_max,phase,tic_pulse,toc_pulse;
 	int tic,toc;
 	int ready;
+	int tracking; // The period is searched only near the one of the previous cycle
 	uint64_t timestamp, last_tic, last_toc, events_from;
+	int event_size; // Of the correlations around each event, see do_locate_events()
+
+	// Arrays, all of them in arena
+	float *samples, *samples_sc, *waveform, *waveform_sc, *tic_c, *toc_c;
+	fftwf_complex *fft, *sc_fft, *tic_fft, *event_c;
 	uint64_t *events;
+	float *scratch; // For the order statistics, sample_rate values
+	float *work; // Temporaries of a period or two, sample_rate + 2 values
+	int *located; // Events before sorting, see locate_events()
+	float *fold; // The samples folded one period per row, see fold_waveform()
 #ifdef DEBUG
 	float *debug;
 #endif
+	void *arena;
+	size_t arena_size;
+
+	fftwf_plan plan_a, plan_b, plan_c, plan_d, plan_e, plan_f; // Shared, see get_plan()
+	int measured; // The plans are final, else some are estimated while they are measured
+	int wisdom_generation; // When the plans were last made, see refresh_plans()
 };
 
+/* Follows the individual beats, see track_beats() */
+struct beat_tracker {
+	int locked;
+	double grid; // Time of the last beat, without the beat error
+	double h; // Interval between two beats, half the period
+	double be; // Tics are be/2 after the grid, tocs be/2 before
+	int tic; // The last beat was a tic
+	double var; // Of the prediction residuals
+	double period, sigma; // Estimates, in samples
+	uint64_t last; // Last event consumed
+	int misses;
+	int fresh; // A beat was accepted in the last TRACKER_FRESH ones
+};
+
+void setup_decimator(struct decimator *d, int factor);
+void reset_decimator(struct decimator *d);
+int run_decimator(struct decimator *d, const float *in, int count, float *out);
+void setup_front_end(struct front_end *fe, int sample_rate, int input_decimation, int env_decimation, int precision, int size);
+void reset_front_end(struct front_end *fe, uint64_t pos);
+int run_front_end(struct front_end *fe, const float *in, int count, float *out, float *energy);
+void setup_suppressor(struct suppressor *s, int sample_rate, int size);
+void reset_suppressor(struct suppressor *s, uint64_t pos);
+void run_suppressor(struct suppressor *s, const float *in, int count, float *energy);
+void prepare_envelope(struct front_end *fe, struct ring_view *v, struct ring_view *energy, uint64_t end, float *out, float *scratch);
+void load_wisdom(char *filename);
+size_t buffers_size(int sample_rate, int sample_count);
 void setup_buffers(struct processing_buffers *b);
-struct processing_buffers *pb_clone(struct processing_buffers *p);
-void pb_destroy_clone(struct processing_buffers *p);
-void process(struct processing_buffers *p, int bph);
+int refresh_plans(struct processing_buffers *p, int count);
+void destroy_buffers(struct processing_buffers *b);
+void process(struct processing_buffers *p, struct ring_view *v, int bph);
+void track_beats(struct beat_tracker *t, struct processing_buffers *p);
 
 /* audio.c */
-int start_portaudio(int *nominal_sample_rate, double *real_sample_rate, char *name);
-int analyze_pa_data(struct processing_buffers *p, int bph, uint64_t events_from);
+struct ladder {
+	int first_step; // -1 for the default of the mode
+	int steps;
+	double sigma_target; // 0 to always display the longest valid window
+};
+
+int start_portaudio(char *name, int longest_step);
+void set_analysis_mode(int precision_mode, int decimation, struct ladder *ladder, int *nominal_sample_rate, double *real_sample_rate);
+int analyze_pa_data(struct processing_buffers *p, int steps, int bph, uint64_t events_from, int first);
+uint64_t get_timestamp();
 int num_inputs();
 const char * input_name(int i);
 
+/* computer.c */
+struct snapshot {
+	struct processing_buffers pb; // Results of the step being displayed
+	int has_data;
+	int is_old; // pb holds the last good result, not a current one
+	int signal; // Number of steps that locked, negative if is_old
+	struct beat_tracker tracker; // Beat by beat estimates
+	int refs; // Readers holding it, protected by the mutex of the computer
+};
+
+struct computer;
+
+struct computer *start_computer(int sample_rate, struct ladder *ladder, int bph);
+void stop_computer(struct computer *c);
+void computer_set_bph(struct computer *c, int bph);
+void computer_set_events_from(struct computer *c, uint64_t events_from);
+int computer_overloaded(struct computer *c);
+struct snapshot *computer_get_snapshot(struct computer *c);
+void computer_put_snapshot(struct computer *c, struct snapshot *s);
+
 /* interface.c */
 struct Settings
 {
 	gchar *audio_input;
 	gdouble rate_adjustment;
 	gboolean precision_mode;
+	int decimation; // Of the captured audio in light mode, 1, 2 or 4
+	int windows; // Steps of the ladder
+	int shortest_window; // s, a power of 2, 0 for the default of the mode
+	double sigma_target;
 	gboolean dark_theme;
 	int window_width, window_height, pane_pos;
 };